@@ -123,7 +123,13 @@ end
 module CSTE = TextEnumMake (struct
                   type t = colorspace
                   let name = "colorspace"
-                  let names = [|"rgb"; "gray"|]
+                  let names = [|"rgb"; "gray"; "rgb-opaque"; "gray-opaque"|]
+                end)
+
+module QTE = TextEnumMake (struct
+                  type t = quality
+                  let name = "quality"
+                  let names = [|"draft"; "balanced"; "exact"|]
                 end)
 
 module MTE = TextEnumMake (struct
@@ -165,16 +171,17 @@ type page =
 
 type tile = opaque * pixmapsize * elapsed
 and elapsed = float
-and pagemapkey = pageno * gen
+and pagemapkey = pageno
 and tilemapkey = pageno * gen * colorspace * angle * w * h * col * row
 and row = int
 and col = int
 and currently =
   | Idle
-  | Loading of (page * gen)
-  | Tiling
-    of (page * opaque * colorspace * angle * gen * col * row * w * h)
   | Outlining of outline list
+and request =
+  | Rpage of (page * gen)
+  | Rtile of (page * colorspace * angle * gen * col * row * w * h)
+and reqid = int
 and mpos = int * int
 and mstate =
   | Mnone
@@ -324,6 +331,8 @@ module S = struct
   let pdims : (pageno * w * h * leftx) list ref = ref []
   let pagecount = ref max_int
   let currently = ref Idle
+  let requests : (reqid, request) Hashtbl.t = Hashtbl.create 0
+  let reqid : reqid ref = ref 0
   let mstate = ref Mnone
   let searchpattern = ref E.s
   let rects : (pageno * rectcolor * rect) list ref = ref []
@@ -362,7 +371,23 @@ module S = struct
   let lnava : (pageno * linkno) option ref = ref None
   let reload : (x * y * float) option ref = ref None
   let nav : anchor nav ref = ref { past = []; future  = []; }
-  let tilelru : (tilemapkey * opaque * pixmapsize) Queue.t = Queue.create ()
+  (* tiles oldest first, an entry is live while its stamp is the one
+     in lrustamps; the others are left behind and skipped *)
+  let tilelru : (tilemapkey * int) Queue.t = Queue.create ()
+  let lrustamps : (tilemapkey, int) Hashtbl.t = Hashtbl.create 0
+  let lrustamp = ref 0
+  let previews : (tilemapkey, unit) Hashtbl.t = Hashtbl.create 0
+  let packed : (tilemapkey, unit) Hashtbl.t = Hashtbl.create 0
+  let fingerprints : (string, pageno) Hashtbl.t = Hashtbl.create 0
+  let twins : (pageno, pageno) Hashtbl.t = Hashtbl.create 0
+  let twinhits : (tilemapkey, unit) Hashtbl.t = Hashtbl.create 0
+  let moving = ref false
+  let lastmove = ref 0.0
+  let drafts : (tilemapkey, unit) Hashtbl.t = Hashtbl.create 0
+  let draftreqs : (reqid, unit) Hashtbl.t = Hashtbl.create 0
+  let pagecosts : (pageno, float * float) Hashtbl.t = Hashtbl.create 0
+  let partials : (tilemapkey, opaque * (int * int) list) Hashtbl.t =
+    Hashtbl.create 0
   let fontpath = ref E.s
   let redirstderr = ref false
 end
@@ -668,6 +693,23 @@ let config_of c attrs =
       | "mupdf-store-size" ->
          { c with mustoresize = maxv ~f:int_of_string_with_suffix 1024 v }
       | "aalevel" -> { c with aalevel = maxv 0 v }
+      | "pipeline-depth" -> { c with pipelinedepth = maxv 1 v }
+      | "tile-budget" -> { c with tilebudget = maxv 0 v }
+      | "batch-tiles" -> { c with batchtiles = bool_of_string v }
+      | "bucket-tiles" -> { c with buckettiles = bool_of_string v }
+      | "progressive-tiles" ->
+         { c with progressivetiles = bool_of_string v }
+      | "banded-tiles" -> { c with bandedtiles = bool_of_string v }
+      | "pack-cold-tiles" -> { c with packtiles = bool_of_string v }
+      | "share-identical-pages" -> { c with sharepages = bool_of_string v }
+      | "pbo-uploads" -> { c with pbouploads = bool_of_string v }
+      | "quality" -> { c with quality = QTE.of_string v }
+      | "motion-quality" -> { c with motionquality = QTE.of_string v }
+      | "bake-colors" -> { c with bakecolors = bool_of_string v }
+      | "tile-gamma" -> { c with tilegamma = float_of_string v }
+      | "page-costs" -> { c with pagecosts = unentS v }
+      | "render-threads" ->
+         { c with renderthreads = bound (int_of_string v) 0 64 }
       | "trim-margins" -> { c with trimmargins = bool_of_string v }
       | "trim-fuzz" -> { c with trimfuzz = irect_of_string v }
       | "uri-launcher" -> { c with urilauncher = unentS v }
@@ -1083,6 +1125,7 @@ let add_attrs bb always dc c time =
   and oc s a b = o (always || a <> b) "%s='%s'" s (color_to_string a)
   and oA s a b = o (always || a <> b) "%s='%s'" s (rgba_to_string a)
   and oC s a b = o (always || a <> b) "%s='%s'" s (CSTE.to_string a)
+  and oQ s a b = o (always || a <> b) "%s='%s'" s (QTE.to_string a)
   and oR s a b = o (always || a <> b) "%s='%s'" s (irect_to_string a)
   and oFm s a b = o (always || a <> b) "%s='%s'" s (FMTE.to_string a)
   and oSv s a b m =
@@ -1135,6 +1178,20 @@ let add_attrs bb always dc c time =
   oi "tile-width" c.tilew dc.tilew;
   oi "tile-height" c.tileh dc.tileh;
   oI "mupdf-store-size" c.mustoresize dc.mustoresize;
+  oi "render-threads" c.renderthreads dc.renderthreads;
+  oi "pipeline-depth" c.pipelinedepth dc.pipelinedepth;
+  oi "tile-budget" c.tilebudget dc.tilebudget;
+  ob "batch-tiles" c.batchtiles dc.batchtiles;
+  ob "bucket-tiles" c.buckettiles dc.buckettiles;
+  ob "progressive-tiles" c.progressivetiles dc.progressivetiles;
+  ob "banded-tiles" c.bandedtiles dc.bandedtiles;
+  ob "pack-cold-tiles" c.packtiles dc.packtiles;
+  ob "share-identical-pages" c.sharepages dc.sharepages;
+  oQ "quality" c.quality dc.quality;
+  oQ "motion-quality" c.motionquality dc.motionquality;
+  ob "bake-colors" c.bakecolors dc.bakecolors;
+  oF "tile-gamma" c.tilegamma dc.tilegamma;
+  ob "pbo-uploads" c.pbouploads dc.pbouploads;
   oi "aalevel" c.aalevel dc.aalevel;
   ob "trim-margins" c.trimmargins dc.trimmargins;
   oR "trim-fuzz" c.trimfuzz dc.trimfuzz;
@@ -1167,6 +1224,7 @@ let add_attrs bb always dc c time =
   ob "coarse-presentation-positioning" c.coarseprespos dc.coarseprespos;
   ob "use-document-css" c.usedoccss dc.usedoccss;
   os "dcf" c.dcf dc.dcf;
+  os "page-costs" c.pagecosts dc.pagecosts;
   os "hint-charset" c.hcs dc.hcs;
   oi "rlw" c.rlw dc.rlw;
   oi "rlh" c.rlh dc.rlh;
@@ -1481,13 +1539,15 @@ let gc () =
 
 let logcurrently = function
   | Idle -> dolog "Idle"
-  | Loading (l, gen) -> dolog "Loading %d gen=%d curgen=%d" l.pageno gen !S.gen
-  | Tiling (l, pageopaque, colorspace, angle, gen, col, row, tilew, tileh) ->
-     dolog "Tiling %d[%d,%d] page=%s cs=%s angle=%d"
-       l.pageno col row (Opaque.to_string pageopaque)
-       (CSTE.to_string colorspace) angle;
+  | Outlining _ -> dolog "outlining"
+
+let logrequest id = function
+  | Rpage (l, gen) ->
+     dolog "[%d] Loading %d gen=%d curgen=%d" id l.pageno gen !S.gen
+  | Rtile (l, colorspace, angle, gen, col, row, tilew, tileh) ->
+     dolog "[%d] Tiling %d[%d,%d] cs=%s angle=%d"
+       id l.pageno col row (CSTE.to_string colorspace) angle;
      dolog "gen=(%d,%d) (%d,%d) tile=(%d,%d) (%d,%d)"
        angle gen conf.angle !S.gen
        tilew tileh
        conf.tilew conf.tileh
-  | Outlining _ -> dolog "outlining"
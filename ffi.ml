@@ -1,7 +1,8 @@
 open Config
 
 type initparams = (angle * fitmodel * trimparams * texcount * sliceheight *
-                     memsize * colorspace * fontpath * redirstderr)
+                     memsize * colorspace * fontpath * redirstderr *
+                     threadcount)
 and xoff = int and yoff = int and noff = int
 and li = (noff * string * hintfontsize * hintchars)
 and hlmask = int and hintchars = string and hintfontsize = int
@@ -22,6 +23,17 @@ external pagebbox : opaque -> irect = "ml_getpagebox"
 external setaalevel : int -> unit = "ml_setaalevel"
 external setpapercolor : rgba -> unit = "ml_setpapercolor"
 external realloctexts : int -> bool = "ml_realloctexts"
+external reprioritize : (reqid * int) array -> unit = "ml_reprioritize"
+external renderstats : unit -> (string * string) array = "ml_renderstats"
+external interrupt : unit -> unit = "ml_interrupt"
+external settilebudget : int -> unit = "ml_settilebudget"
+external setpiglimit : int -> unit = "ml_setpiglimit"
+external setbuckets : int -> int -> unit = "ml_setbuckets"
+external setbandedtiles : bool -> unit = "ml_setbandedtiles"
+external packtile : opaque -> int = "ml_packtile"
+external unpacktile : opaque -> int = "ml_unpacktile"
+external setsharepages : bool -> unit = "ml_setsharepages"
+external setbake : bool -> bool -> float -> rgba -> unit = "ml_setbake"
 external findlink : opaque -> linkdir -> link = "ml_findlink"
 external getlink : opaque -> int -> under = "ml_getlink"
 external getlinkn : opaque -> string -> string -> int -> int = "ml_getlinkn"
@@ -35,14 +47,19 @@ external drawtile : tileparams -> opaque -> unit = "ml_drawtile"
 external rectofblock : opaque -> int -> int -> float array option
   = "ml_rectofblock"
 external begintiles : unit -> unit = "ml_begintiles"
+external endframe : unit -> unit = "ml_endframe"
+external setpbo : bool -> unit = "ml_setpbo"
+external stagetile : opaque -> unit = "ml_stagetile"
 external endtiles : unit -> unit = "ml_endtiles"
 external addannot : opaque -> int -> int -> string -> unit = "ml_addannot"
 external modannot : opaque -> slinkindex -> string -> unit = "ml_modannot"
 external delannot : opaque -> slinkindex -> unit = "ml_delannot"
 external hasunsavedchanges : unit -> bool = "ml_hasunsavedchanges"
 external savedoc : string -> unit = "ml_savedoc"
-external gettextannot : opaque -> slinkindex -> string = "ml_gettextannot"
-external getfileannot : opaque -> slinkindex -> string = "ml_getfileannot"
+external gettextannot : opaque -> slinkindex -> string option
+  = "ml_gettextannot"
+external getfileannot : opaque -> slinkindex -> string option
+  = "ml_getfileannot"
 external savefileannot : opaque -> slinkindex -> string -> unit
   = "ml_savefileannot"
 external wcmd : Unix.file_descr -> bytes -> int -> unit = "ml_wcmd"
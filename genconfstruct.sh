@@ -6,7 +6,8 @@ type rgb = (float * float * float)
 and rgba = (float * float * float * float)
 and fitmodel = | FitWidth | FitProportional | FitPage
 and irect = (int * int * int * int)
-and colorspace = | Rgb | Gray
+and colorspace = | Rgb | Gray | Rgbopaque | Grayopaque
+and quality = | Draft | Balanced | Exact
 and keymap =
   | KMinsrt of key | KMinsrl of key list | KMmulti of (key list * key list)
 and key = (int * int)
@@ -32,6 +33,7 @@ and pdimno = int and pageno = int
 and x = int and y = int and leftx = int and w = int and  h = int
 and covercount = int
 and memsize = int and texcount = int
+and threadcount = int
 and sliceheight = int
 and zoom = float
 let scrollbvv = 1 and scrollbhv = 2
@@ -94,6 +96,20 @@ g texturecolor rgba "(0.0, 0.0, 0.0, 0.0)"
 i tilew 2048
 i tileh 2048
 g mustoresize memsize "256 lsl 20"
+g renderthreads threadcount 0
+i pipelinedepth 8
+i tilebudget 0
+b batchtiles false
+b buckettiles false
+b progressivetiles false
+b bandedtiles false
+b packtiles false
+b sharepages false
+g quality quality Exact
+g motionquality quality Exact
+b bakecolors false
+f tilegamma 1.
+b pbouploads true
 i aalevel 8
 s urilauncher "{|$uopen|}"
 s pathlauncher "{|$print|}"
@@ -126,6 +142,7 @@ b coarseprespos false
 g css css Utils.E.s
 b usedoccss true
 s key Utils.E.s
+s pagecosts Utils.E.s
 P pax
 g dcf dcf Utils.E.s
 s hcs "{|aoeuidhtns|}"
@@ -18,6 +18,10 @@
 #include <unistd.h>
 #include <wchar.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef LLPARANOIDP
 #pragma GCC diagnostic error "-Weverything"
 #pragma GCC diagnostic ignored "-Wpadded"
@@ -30,6 +34,7 @@
 #pragma GCC diagnostic error "-Wcast-qual"
 #endif
 
+#define GL_GLEXT_PROTOTYPES
 #include GL_H
 
 #define CAML_NAME_SPACE
@@ -58,12 +63,18 @@
 #define ML(d) extern value ml_##d; value ml_##d
 #define ML0(d) extern void ml_##d; void ml_##d
 #define STTI(st) ((unsigned int) (st))
+#define PREVIEWSCALE 4
+#define PBOCOUNT 4
+#define PIGWARM 2
+#define PIGSHARE 4
 
 enum { Copen=23, Ccs, Cfreepage, Cfreetile, Csearch, Cgeometry, Creqlayout,
-       Cpage, Ctile, Ctrimset, Csettrim, Csliceh, Cinterrupt };
+       Cpage, Ctile, Ctrimset, Csettrim, Csliceh, Cinterrupt, Ctiles,
+       Ccost };
 enum { FitWidth, FitProportional, FitPage };
 enum { LDfirst, LDlast };
 enum { LDfirstvisible, LDleft, LDright, LDdown, LDup };
+enum { JobTile, JobPage, JobStrip, JobBuckets };
 enum { Uuri, Utext, Utextannot, Ufileannot, Unone };
 enum { MarkPage, MarkBlock, MarkLine, MarkWord };
 
@@ -74,12 +85,82 @@ struct slice {
 
 struct tile {
     int w, h;
+    int scale;
+    /* a tile of nothing but paper keeps no pixmap, just its color */
+    int solid;
+    unsigned char color[4];
     int slicecount;
     int sliceheight;
+    unsigned long serial;
     fz_pixmap *pixmap;
+    struct packed *packed;
     struct slice slices[1];
 };
 
+/* the pixels of a cold tile, run-length encoded by pixel: a 16 bit
+   word whose top bit tells a run of one repeated pixel from a stretch
+   of literal ones, and whose low bits count them, then the pixel(s) */
+struct packed {
+    fz_irect bbox;
+    fz_colorspace *colorspace;
+    int alpha;
+    size_t size;
+    unsigned char data[];
+};
+
+struct renderjob;
+
+struct band {
+    struct renderjob *job;
+    fz_irect rect;
+    fz_cookie cookie;
+};
+
+struct strippart {
+    int id, x;
+    struct tile *tile;
+};
+
+struct strip {
+    fz_pixmap *pixmap;
+    int count;
+    struct strippart parts[];
+};
+
+/* Inversion (tinted towards the texture color) and gamma applied to
+   the tiles by the render pool, instead of by a GL texture blend every
+   frame, see ml_setbake.  Channels 0-2 are red, green and blue, 3 is
+   the gray of gray tiles, alpha is left alone.  Without gamma the
+   transform is affine, y = add + (x * mul >> 7), and goes 16 bytes at
+   a time where SSE2 is there; the table covers the rest */
+struct bake {
+    int active, affine;
+    short mul[4], add[4];
+    unsigned char lut[4][256];
+};
+
+struct renderjob {
+    struct renderjob *next;
+    struct page *page;
+    struct strip *strip;
+    int kind;
+    int id, x, y, pageno, pindex, pdimgen;
+    int prio, cancelled;
+    int aalevel, quality, scale, bucketed, banded, gen;
+    int bandcount, nextband, bandsleft;
+    /* when the first band was picked up, replies report the time
+       spent rendering and not the wait in the queue */
+    double begin;
+    float papercolor[4];
+    struct bake bake;
+    fz_matrix ctm;
+    struct tile *tile;
+    fz_display_list *dlist;
+    struct imagecache *imagecache;
+    struct buckets *buckets;
+    struct band bands[];
+};
+
 struct pagedim {
     int pageno;
     int rotate;
@@ -93,6 +174,7 @@ struct pagedim {
 
 struct slink {
     enum { SLINK, SANNOT } tag;
+    int type;
     fz_irect bbox;
     union {
         fz_link *link;
@@ -101,10 +183,29 @@ struct slink {
 };
 
 struct annot {
+    int type;
     fz_irect bbox;
     pdf_annot *annot;
 };
 
+/* filled by a pool job and held by it and the page; ready is 1 once
+   the lists can be used, -1 if they never will be, and like refs it
+   is under the pool mutex */
+struct buckets {
+    int gen, w, h, cols, rows;
+    int refs, ready;
+    fz_irect bounds;
+    fz_cookie cookie;
+    fz_display_list *lists[];
+};
+
+struct imagecache {
+    pthread_mutex_t mutex;
+    int refs, gen;
+    fz_image *image, *scaled;
+    fz_matrix ctm;
+};
+
 struct page {
     int tgen;
     int sgen;
@@ -114,12 +215,26 @@ struct page {
     fz_stext_page *text;
     fz_page *fzpage;
     fz_display_list *dlist;
+    struct buckets *buckets;
+    struct imagecache *imagecache;
+    fz_rect contentbox;
+    uint64_t fingerprint;
     fz_link *links;
     int slinkcount;
     struct slink *slinks;
     int annotcount;
     struct annot *annots;
     fz_stext_char *fmark, *lmark;
+    /* guards the links, annotations, text and marks together with
+       the view they were made for (see lockpage) */
+    pthread_mutex_t mutex;
+    fz_matrix ctm;
+    fz_irect bounds;
+    fz_rect mediabox;
+    /* pdf_page_transform of the page, so that its ctm can be had
+       without the document */
+    int pdf;
+    fz_matrix pdfctm;
 };
 
 static struct {
@@ -128,52 +243,140 @@ static struct {
     struct pagedim *pagedims;
     int pagecount;
     int pagedimcount;
+    /* bumped when pagedims are rebuilt, page jobs queued against the
+       old ones give up (the UI asks again with a valid index) */
+    int pdimgen;
     fz_document *doc;
     fz_context *ctx;
+    /* the UI thread's own, for what it does without the document */
+    fz_context *uictx;
+    /* the command thread's, for queueing tiles while a worker holds
+       the document */
+    fz_context *cmdctx;
     int w, h;
     char *dcf;
     int pfds[2];
 
+    /* slots are reused least recently drawn first, used is the frame
+       that last drew from the slot */
     struct {
-        int index, count;
+        int count;
         GLuint *ids;
         GLenum iform, form, ty;
+        unsigned long frame;
+        long hits, evictions, onscreen;
         struct {
             int w, h;
+            GLenum iform;
+            unsigned long used;
             struct slice *slice;
         } *owners;
     } tex;
 
+    /* freshly rendered tiles are handed to a ring of pixel buffers as
+       they arrive, the driver moves them on its own time and the draw
+       only has to fill textures from them; a slot is matched by tile
+       and serial, the tile may have been freed since it was staged.
+       count is 0 when the buffers are unavailable or turned off */
+    struct {
+        int count, index, usable;
+        struct {
+            GLuint id;
+            struct tile *tile;
+            unsigned long serial;
+        } slots[PBOCOUNT];
+        long uploads, stagings, staged, frames, bytes, framebytes;
+        double time, frametime, worst;
+    } pbo;
+
     fz_colorspace *colorspace;
+    int alpha;
     float papercolor[4];
 
     FT_Face face;
-    fz_pixmap *pig;
+    /* recycled tile pixmaps, most recently freed first, taking up to
+       limit bytes on top of the pixmap cache; all but PIGWARM of them
+       are dropped whenever the pool runs out of work */
+    struct {
+        int count, size;
+        size_t bytes, limit;
+        fz_pixmap **slots;
+    } pigs;
     pthread_t thread;
+    pthread_mutex_t printmutex;
+    pthread_mutex_t fzmutexes[FZ_LOCK_MAX];
+
+    struct {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond, idle;
+        struct renderjob *head, *running;
+        int count, pending, queued, busy;
+        long rendered, cancelled, aborted, budgethits, previews, pages, strips;
+        long imagetiles, pighits, pigmisses, blanktiles, graytiles;
+        long packs, unpacks, packedin, packedout, bakes;
+        double unpacktime, baketime;
+        long tilecount[2];
+        double budget, tiletime[2];
+        float *pagecost;
+        pthread_t *threads;
+    } pool;
+
     fz_irect trimfuzz;
-    GLuint stid, boid;
+    fz_cookie cookie;
+    /* what pages and tiles are made with, like papercolor under the
+       pool mutex since queueing does not take the document */
+    int bucketw, bucketh, bandedtiles, sharepages;
+    struct bake bake;
+    GLuint stid, boid, solidtex;
     int trimmargins, needoutline, gen, rotate, aalevel,
         fitmodel, trimanew, csock, dirty, utf8cs;
 
     GLfloat texcoords[8], vertices[16];
-} state = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+} state = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .printmutex = PTHREAD_MUTEX_INITIALIZER,
+    .pool = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .idle = PTHREAD_COND_INITIALIZER
+    }
+};
 
-static void lock (const char *cap)
+static void lockmutex (pthread_mutex_t *mutex, const char *cap)
 {
-    int ret = pthread_mutex_lock (&state.mutex);
+    int ret = pthread_mutex_lock (mutex);
     if (ret) {
         errx (1, "%s: pthread_mutex_lock: %d(%s)", cap, ret, strerror (ret));
     }
 }
 
-static void unlock (const char *cap)
+static void unlockmutex (pthread_mutex_t *mutex, const char *cap)
 {
-    int ret = pthread_mutex_unlock (&state.mutex);
+    int ret = pthread_mutex_unlock (mutex);
     if (ret) {
         errx (1, "%s: pthread_mutex_unlock: %d(%s)", cap, ret, strerror (ret));
     }
 }
 
+static void waitcond (pthread_cond_t *cond, pthread_mutex_t *mutex,
+                      const char *cap)
+{
+    int ret = pthread_cond_wait (cond, mutex);
+    if (ret) {
+        errx (1, "%s: pthread_cond_wait: %d(%s)", cap, ret, strerror (ret));
+    }
+}
+
+static void lock (const char *cap)
+{
+    lockmutex (&state.mutex, cap);
+}
+
+static void unlock (const char *cap)
+{
+    unlockmutex (&state.mutex, cap);
+}
+
 static int trylock (const char *cap)
 {
     int ret = pthread_mutex_trylock (&state.mutex);
@@ -278,7 +481,9 @@ static void GCC_FMT_ATTR (1, 2) printd (const char *fmt, ...)
 
         if (len > -1) {
             if (len < size - 4) {
+                lockmutex (&state.printmutex, "printd");
                 writedata (state.csock, buf, len);
+                unlockmutex (&state.printmutex, "printd");
                 break;
             }
             else {
@@ -405,25 +610,156 @@ static void unlinktile (struct tile *tile)
     }
 }
 
+static struct imagecache *keepimagecache (struct imagecache *cache)
+{
+    if (cache) {
+        lockmutex (&cache->mutex, "keepimagecache");
+        cache->refs++;
+        unlockmutex (&cache->mutex, "keepimagecache");
+    }
+    return cache;
+}
+
+static void dropimagecache (fz_context *ctx, struct imagecache *cache)
+{
+    int refs;
+
+    if (cache) {
+        lockmutex (&cache->mutex, "dropimagecache");
+        refs = --cache->refs;
+        unlockmutex (&cache->mutex, "dropimagecache");
+        if (!refs) {
+            fz_drop_image (ctx, cache->scaled);
+            fz_drop_image (ctx, cache->image);
+            pthread_mutex_destroy (&cache->mutex);
+            free (cache);
+        }
+    }
+}
+
+static void freebuckets (fz_context *ctx, struct buckets *buckets)
+{
+    if (buckets) {
+        for (int i = 0; i < buckets->cols * buckets->rows; ++i) {
+            fz_drop_display_list (ctx, buckets->lists[i]);
+        }
+        free (buckets);
+    }
+}
+
+/* the page letting go of buckets that are still being filled stops
+   the job, whichever of the two is last frees them */
+static void dropbuckets (fz_context *ctx, struct buckets *buckets)
+{
+    int refs;
+
+    if (buckets) {
+        buckets->cookie.abort = 1;
+        lockmutex (&state.pool.mutex, "dropbuckets");
+        refs = --buckets->refs;
+        unlockmutex (&state.pool.mutex, "dropbuckets");
+        if (!refs) {
+            freebuckets (ctx, buckets);
+        }
+    }
+}
+
 static void freepage (struct page *page)
 {
     if (page) {
         fz_drop_stext_page (state.ctx, page->text);
         free (page->slinks);
+        dropbuckets (state.ctx, page->buckets);
+        dropimagecache (state.ctx, page->imagecache);
         fz_drop_display_list (state.ctx, page->dlist);
         fz_drop_page (state.ctx, page->fzpage);
+        pthread_mutex_destroy (&page->mutex);
         free (page);
     }
 }
 
+/* workers hand back pixmaps too, hence the pool is under the pool
+   mutex rather than the document lock */
+static size_t pigbytes (fz_pixmap *pixmap)
+{
+    return (size_t) pixmap->stride * pixmap->h;
+}
+
+/* under the pool mutex, drops the least recently freed pixmaps until
+   what is left fits both counts */
+static void trimpigs (fz_context *ctx, size_t bytes, int count)
+{
+    while (state.pigs.count > count || state.pigs.bytes > bytes) {
+        fz_pixmap *pig = state.pigs.slots[--state.pigs.count];
+
+        state.pigs.bytes -= pigbytes (pig);
+        fz_drop_pixmap (ctx, pig);
+    }
+}
+
+static void putpig (fz_context *ctx, fz_pixmap *pixmap)
+{
+    lockmutex (&state.pool.mutex, "putpig");
+    if (pigbytes (pixmap) > state.pigs.limit) {
+        fz_drop_pixmap (ctx, pixmap);
+        unlockmutex (&state.pool.mutex, "putpig");
+        return;
+    }
+    if (state.pigs.count == state.pigs.size) {
+        int size = state.pigs.size ? state.pigs.size * 2 : 8;
+
+        state.pigs.slots = realloc (state.pigs.slots,
+                                    size * sizeof (*state.pigs.slots));
+        if (!state.pigs.slots) {
+            err (1, errno, "realloc pigs %d", size);
+        }
+        state.pigs.size = size;
+    }
+    memmove (&state.pigs.slots[1], &state.pigs.slots[0],
+             state.pigs.count * sizeof (*state.pigs.slots));
+    state.pigs.slots[0] = pixmap;
+    state.pigs.count++;
+    state.pigs.bytes += pigbytes (pixmap);
+    trimpigs (ctx, state.pigs.limit, state.pigs.count);
+    unlockmutex (&state.pool.mutex, "putpig");
+}
+
+/* tiles belong to the command thread, freeing one needs its context
+   and the pool mutex (for the pigs) but not the document */
 static void freetile (struct tile *tile)
 {
+    fz_context *ctx = state.cmdctx;
+    fz_pixmap *pixmap = tile->pixmap;
+
     unlinktile (tile);
-    fz_drop_pixmap (state.ctx, state.pig);
-    state.pig = tile->pixmap;
+    if (tile->packed) {
+        fz_drop_colorspace (ctx, tile->packed->colorspace);
+        free (tile->packed);
+    }
+    if (pixmap) {
+        if (pixmap->colorspace == state.colorspace
+            && pixmap->alpha == state.alpha) {
+            putpig (ctx, pixmap);
+        }
+        else {
+            fz_drop_pixmap (ctx, pixmap);
+        }
+    }
     free (tile);
 }
 
+static fz_matrix trimmatrix (struct pagedim *pdim, fz_matrix page_ctm)
+{
+    fz_rect realbox;
+    fz_matrix ctm;
+
+    ctm = fz_concat (fz_rotate (-pdim->rotate), fz_scale (1, -1));
+    realbox = fz_transform_rect (pdim->mediabox, ctm);
+    return fz_concat (
+        fz_invert_matrix (page_ctm),
+        fz_concat (ctm, fz_translate (-realbox.x0, -realbox.y0)));
+}
+
 static void trimctm (pdf_page *page, int pindex)
 {
     struct pagedim *pdim = &state.pagedims[pindex];
@@ -432,15 +768,11 @@ static void trimctm (pdf_page *page, int pindex)
         return;
     }
     if (!pdim->tctmready) {
-        fz_rect realbox, mediabox;
-        fz_matrix page_ctm, ctm;
+        fz_rect mediabox;
+        fz_matrix page_ctm;
 
-        ctm = fz_concat (fz_rotate (-pdim->rotate), fz_scale (1, -1));
-        realbox = fz_transform_rect (pdim->mediabox, ctm);
         pdf_page_transform (state.ctx, page, &mediabox, &page_ctm);
-        pdim->tctm = fz_concat (
-            fz_invert_matrix (page_ctm),
-            fz_concat (ctm, fz_translate (-realbox.x0, -realbox.y0)));
+        pdim->tctm = trimmatrix (pdim, page_ctm);
         pdim->tctmready = 1;
     }
 }
@@ -462,115 +794,2266 @@ static fz_matrix pagectm1 (fz_page *fzpage, struct pagedim *pdim)
     return ctm;
 }
 
+/* needs only the layout, not the document */
 static fz_matrix pagectm (struct page *page)
 {
-    return pagectm1 (page->fzpage, &state.pagedims[page->pdimno]);
+    struct pagedim *pdim = &state.pagedims[page->pdimno];
+
+    if (page->pdf) {
+        return fz_concat (trimmatrix (pdim, page->pdfctm), pdim->ctm);
+    }
+    return fz_concat (fz_translate (-pdim->mediabox.x0, -pdim->mediabox.y0),
+                      pdim->ctm);
 }
 
-static void *loadpage (int pageno, int pindex)
+/* Pages that consist of nothing but one image (comic books, scans)
+   skip the display list when rendering: the image is decoded once
+   per layout at the size it will be shown at (letting the decoder
+   subsample, e.g. JPEG DCT scaling) and the tiles of the page are
+   all cut from that */
+struct imagedev {
+    fz_device super;
+    int count, other;
+    fz_image *image;
+    fz_matrix ctm;
+};
+
+static void image_fill_image (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                              fz_image *image, fz_matrix ctm, float alpha,
+                              fz_color_params UNUSED_ATTR cp)
 {
-    fz_device *dev;
-    struct page *page;
+    struct imagedev *idev = (struct imagedev *) dev;
 
-    page = calloc (sizeof (struct page), 1);
-    if (!page) {
-        err (1, errno, "calloc page %d", pageno);
+    if (idev->count++ == 0 && alpha == 1.0f) {
+        idev->image = image;
+        idev->ctm = ctm;
+    }
+    else {
+        idev->other = 1;
     }
+}
 
-    page->dlist = fz_new_display_list (state.ctx, fz_infinite_rect);
-    dev = fz_new_list_device (state.ctx, page->dlist);
-    fz_try (state.ctx) {
-        page->fzpage = fz_load_page (state.ctx, state.doc, pageno);
-        fz_run_page (state.ctx, page->fzpage, dev, fz_identity, NULL);
+static void image_fill_path (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                             const fz_path UNUSED_ATTR *path,
+                             int UNUSED_ATTR even_odd,
+                             fz_matrix UNUSED_ATTR ctm,
+                             fz_colorspace UNUSED_ATTR *cs,
+                             const float UNUSED_ATTR *color,
+                             float UNUSED_ATTR alpha,
+                             fz_color_params UNUSED_ATTR cp)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_stroke_path (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                               const fz_path UNUSED_ATTR *path,
+                               const fz_stroke_state UNUSED_ATTR *stroke,
+                               fz_matrix UNUSED_ATTR ctm,
+                               fz_colorspace UNUSED_ATTR *cs,
+                               const float UNUSED_ATTR *color,
+                               float UNUSED_ATTR alpha,
+                               fz_color_params UNUSED_ATTR cp)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_clip_path (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                             const fz_path UNUSED_ATTR *path,
+                             int UNUSED_ATTR even_odd,
+                             fz_matrix UNUSED_ATTR ctm,
+                             fz_rect UNUSED_ATTR scissor)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_clip_stroke_path (fz_context UNUSED_ATTR *ctx,
+                                    fz_device *dev,
+                                    const fz_path UNUSED_ATTR *path,
+                                    const fz_stroke_state UNUSED_ATTR *stroke,
+                                    fz_matrix UNUSED_ATTR ctm,
+                                    fz_rect UNUSED_ATTR scissor)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_fill_text (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                             const fz_text UNUSED_ATTR *text,
+                             fz_matrix UNUSED_ATTR ctm,
+                             fz_colorspace UNUSED_ATTR *cs,
+                             const float UNUSED_ATTR *color,
+                             float UNUSED_ATTR alpha,
+                             fz_color_params UNUSED_ATTR cp)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_stroke_text (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                               const fz_text UNUSED_ATTR *text,
+                               const fz_stroke_state UNUSED_ATTR *stroke,
+                               fz_matrix UNUSED_ATTR ctm,
+                               fz_colorspace UNUSED_ATTR *cs,
+                               const float UNUSED_ATTR *color,
+                               float UNUSED_ATTR alpha,
+                               fz_color_params UNUSED_ATTR cp)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_clip_text (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                             const fz_text UNUSED_ATTR *text,
+                             fz_matrix UNUSED_ATTR ctm,
+                             fz_rect UNUSED_ATTR scissor)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_clip_stroke_text (fz_context UNUSED_ATTR *ctx,
+                                    fz_device *dev,
+                                    const fz_text UNUSED_ATTR *text,
+                                    const fz_stroke_state UNUSED_ATTR *stroke,
+                                    fz_matrix UNUSED_ATTR ctm,
+                                    fz_rect UNUSED_ATTR scissor)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_fill_shade (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                              fz_shade UNUSED_ATTR *shade,
+                              fz_matrix UNUSED_ATTR ctm,
+                              float UNUSED_ATTR alpha,
+                              fz_color_params UNUSED_ATTR cp)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_fill_image_mask (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                                   fz_image UNUSED_ATTR *image,
+                                   fz_matrix UNUSED_ATTR ctm,
+                                   fz_colorspace UNUSED_ATTR *cs,
+                                   const float UNUSED_ATTR *color,
+                                   float UNUSED_ATTR alpha,
+                                   fz_color_params UNUSED_ATTR cp)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_clip_image_mask (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                                   fz_image UNUSED_ATTR *image,
+                                   fz_matrix UNUSED_ATTR ctm,
+                                   fz_rect UNUSED_ATTR scissor)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_begin_mask (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                              fz_rect UNUSED_ATTR area,
+                              int UNUSED_ATTR luminosity,
+                              fz_colorspace UNUSED_ATTR *cs,
+                              const float UNUSED_ATTR *bc,
+                              fz_color_params UNUSED_ATTR cp)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static void image_begin_group (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                               fz_rect UNUSED_ATTR area,
+                               fz_colorspace UNUSED_ATTR *cs,
+                               int UNUSED_ATTR isolated,
+                               int UNUSED_ATTR knockout,
+                               int UNUSED_ATTR blendmode,
+                               float UNUSED_ATTR alpha)
+{
+    ((struct imagedev *) dev)->other = 1;
+}
+
+static int image_begin_tile (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                             fz_rect UNUSED_ATTR area,
+                             fz_rect UNUSED_ATTR view, float UNUSED_ATTR xstep,
+                             float UNUSED_ATTR ystep,
+                             fz_matrix UNUSED_ATTR ctm, int UNUSED_ATTR id)
+{
+    ((struct imagedev *) dev)->other = 1;
+    return 1;
+}
+
+static struct imagecache *findimage (fz_context *ctx, fz_display_list *dlist)
+{
+    struct imagedev *idev = NULL;
+    struct imagecache *cache = NULL;
+
+    fz_var (idev);
+    fz_var (cache);
+    fz_try (ctx) {
+        idev = fz_new_derived_device (ctx, struct imagedev);
+        idev->super.fill_path = image_fill_path;
+        idev->super.stroke_path = image_stroke_path;
+        idev->super.clip_path = image_clip_path;
+        idev->super.clip_stroke_path = image_clip_stroke_path;
+        idev->super.fill_text = image_fill_text;
+        idev->super.stroke_text = image_stroke_text;
+        idev->super.clip_text = image_clip_text;
+        idev->super.clip_stroke_text = image_clip_stroke_text;
+        idev->super.fill_shade = image_fill_shade;
+        idev->super.fill_image = image_fill_image;
+        idev->super.fill_image_mask = image_fill_image_mask;
+        idev->super.clip_image_mask = image_clip_image_mask;
+        idev->super.begin_mask = image_begin_mask;
+        idev->super.begin_group = image_begin_group;
+        idev->super.begin_tile = image_begin_tile;
+        fz_run_display_list (ctx, dlist, &idev->super, fz_identity,
+                             fz_infinite_rect, NULL);
+        fz_close_device (ctx, &idev->super);
+
+        if (idev->count == 1 && !idev->other) {
+            cache = calloc (sizeof (*cache), 1);
+            if (!cache) {
+                err (1, errno, "calloc imagecache");
+            }
+            pthread_mutex_init (&cache->mutex, NULL);
+            cache->refs = 1;
+            cache->image = fz_keep_image (ctx, idev->image);
+            cache->ctm = idev->ctm;
+        }
     }
-    fz_catch (state.ctx) {
-        page->fzpage = NULL;
+    fz_always (ctx) {
+        fz_drop_device (ctx, (fz_device *) idev);
     }
-    fz_close_device (state.ctx, dev);
-    fz_drop_device (state.ctx, dev);
+    fz_catch (ctx) {
+        cache = NULL;
+    }
+    return cache;
+}
 
-    page->pdimno = pindex;
-    page->pageno = pageno;
-    page->sgen = state.gen;
-    page->agen = state.gen;
-    page->tgen = state.gen;
-    return page;
+/* tiles that fall outside of everything the page draws are known to
+   be blank before rendering them */
+static fz_rect contentbox (fz_context *ctx, fz_display_list *dlist)
+{
+    fz_rect rect = fz_empty_rect;
+    fz_device *dev = NULL;
+
+    fz_var (dev);
+    fz_try (ctx) {
+        dev = fz_new_bbox_device (ctx, &rect);
+        fz_run_display_list (ctx, dlist, dev, fz_identity,
+                             fz_infinite_rect, NULL);
+        fz_close_device (ctx, dev);
+    }
+    fz_always (ctx) {
+        fz_drop_device (ctx, dev);
+    }
+    fz_catch (ctx) {
+        rect = fz_infinite_rect;
+    }
+    return rect;
 }
 
-static struct tile *alloctile (int h)
+/* Identical pages (blank separators, repeated templates) are told
+   apart from the rest by a digest of everything their display list
+   draws, the UI lets pages with the same digest share tiles.  Fonts
+   and images go in by their data, not by address, and anything that
+   can not be pinned down that way (shadings, fonts without a file)
+   leaves the page without a digest */
+struct hashdev {
+    fz_device super;
+    uint64_t hash;
+    int failed;
+};
+
+enum { HashFill, HashStroke, HashClip, HashClipStroke, HashText,
+       HashStrokeText, HashClipText, HashClipStrokeText, HashImage,
+       HashImageMask, HashClipImageMask, HashPopClip, HashMask,
+       HashEndMask, HashGroup, HashEndGroup, HashTile, HashEndTile,
+       HashMove, HashLine, HashCurve, HashClose };
+
+static void hashbytes (struct hashdev *hdev, const void *p, size_t len)
 {
-    int slicecount;
-    size_t tilesize;
-    struct tile *tile;
+    const unsigned char *s = p;
+    uint64_t hash = hdev->hash;
 
-    slicecount = (h + state.sliceheight - 1) / state.sliceheight;
-    tilesize = sizeof (*tile) + ((slicecount - 1) * sizeof (struct slice));
-    tile = calloc (tilesize, 1);
-    if (!tile) {
-        err (1, errno, "cannot allocate tile (%zu bytes)", tilesize);
+    /* FNV-1a */
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ s[i]) * 0x100000001b3ull;
+    }
+    hdev->hash = hash;
+}
+
+static void hashint (struct hashdev *hdev, int i)
+{
+    hashbytes (hdev, &i, sizeof (i));
+}
+
+static void hashfloats (struct hashdev *hdev, const float *f, int n)
+{
+    hashbytes (hdev, f, n * sizeof (*f));
+}
+
+static void hashmatrix (struct hashdev *hdev, fz_matrix m)
+{
+    float f[6] = { m.a, m.b, m.c, m.d, m.e, m.f };
+
+    hashfloats (hdev, f, 6);
+}
+
+static void hashrect (struct hashdev *hdev, fz_rect r)
+{
+    float f[4] = { r.x0, r.y0, r.x1, r.y1 };
+
+    hashfloats (hdev, f, 4);
+}
+
+static void hashcolor (fz_context *ctx, struct hashdev *hdev,
+                       fz_colorspace *cs, const float *color,
+                       float alpha, fz_color_params cp)
+{
+    int cpi[4] = { cp.ri, cp.bp, cp.op, cp.opm };
+
+    if (cs) {
+        const char *name = fz_colorspace_name (ctx, cs);
+        int n = fz_colorspace_n (ctx, cs);
+
+        hashbytes (hdev, name, strlen (name));
+        hashint (hdev, n);
+        if (color) {
+            hashfloats (hdev, color, n);
+        }
+    }
+    hashfloats (hdev, &alpha, 1);
+    hashbytes (hdev, cpi, sizeof (cpi));
+}
+
+static void hash_moveto (fz_context UNUSED_ATTR *ctx, void *arg,
+                         float x, float y)
+{
+    float f[2] = { x, y };
+
+    hashint (arg, HashMove);
+    hashfloats (arg, f, 2);
+}
+
+static void hash_lineto (fz_context UNUSED_ATTR *ctx, void *arg,
+                         float x, float y)
+{
+    float f[2] = { x, y };
+
+    hashint (arg, HashLine);
+    hashfloats (arg, f, 2);
+}
+
+static void hash_curveto (fz_context UNUSED_ATTR *ctx, void *arg,
+                          float x1, float y1, float x2, float y2,
+                          float x3, float y3)
+{
+    float f[6] = { x1, y1, x2, y2, x3, y3 };
+
+    hashint (arg, HashCurve);
+    hashfloats (arg, f, 6);
+}
+
+static void hash_closepath (fz_context UNUSED_ATTR *ctx, void *arg)
+{
+    hashint (arg, HashClose);
+}
+
+static void hashpath (fz_context *ctx, struct hashdev *hdev,
+                      const fz_path *path)
+{
+    static const fz_path_walker walker = {
+        hash_moveto, hash_lineto, hash_curveto, hash_closepath,
+        NULL, NULL, NULL, NULL
+    };
+
+    fz_walk_path (ctx, path, &walker, hdev);
+}
+
+static void hashstroke (struct hashdev *hdev, const fz_stroke_state *stroke)
+{
+    int caps[4] = {
+        stroke->start_cap, stroke->dash_cap, stroke->end_cap, stroke->linejoin
+    };
+    float f[3] = { stroke->linewidth, stroke->miterlimit, stroke->dash_phase };
+
+    hashbytes (hdev, caps, sizeof (caps));
+    hashfloats (hdev, f, 3);
+    hashint (hdev, stroke->dash_len);
+    hashfloats (hdev, stroke->dash_list, stroke->dash_len);
+}
+
+static void hashtext (fz_context *ctx, struct hashdev *hdev,
+                      const fz_text *text)
+{
+    for (fz_text_span *span = text->head; span; span = span->next) {
+        unsigned char digest[16];
+
+        fz_try (ctx) {
+            fz_font_digest (ctx, span->font, digest);
+        }
+        fz_catch (ctx) {
+            hdev->failed = 1;
+            return;
+        }
+        hashbytes (hdev, digest, sizeof (digest));
+        hashmatrix (hdev, span->trm);
+        hashint (hdev, span->wmode);
+        for (int i = 0; i < span->len; ++i) {
+            fz_text_item *item = &span->items[i];
+            float f[2] = { item->x, item->y };
+            int g[2] = { item->gid, item->ucs };
+
+            hashfloats (hdev, f, 2);
+            hashbytes (hdev, g, sizeof (g));
+        }
+    }
+}
+
+static void hashimage (fz_context *ctx, struct hashdev *hdev,
+                       fz_image *image)
+{
+    fz_compressed_buffer *cbuf;
+
+    for (; image; image = image->mask) {
+        int dims[5] = {
+            image->w, image->h, image->n, image->bpc, image->imagemask
+        };
+
+        cbuf = fz_compressed_image_buffer (ctx, image);
+        if (!cbuf || !cbuf->buffer) {
+            hdev->failed = 1;
+            return;
+        }
+        hashbytes (hdev, dims, sizeof (dims));
+        hashcolor (ctx, hdev, image->colorspace, NULL, 1, fz_default_color_params);
+        hashbytes (hdev, cbuf->buffer->data, cbuf->buffer->len);
+    }
+}
+
+static void hash_fill_path (fz_context *ctx, fz_device *dev,
+                            const fz_path *path, int even_odd,
+                            fz_matrix ctm, fz_colorspace *cs,
+                            const float *color, float alpha,
+                            fz_color_params cp)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashFill);
+    hashpath (ctx, hdev, path);
+    hashint (hdev, even_odd);
+    hashmatrix (hdev, ctm);
+    hashcolor (ctx, hdev, cs, color, alpha, cp);
+}
+
+static void hash_stroke_path (fz_context *ctx, fz_device *dev,
+                              const fz_path *path,
+                              const fz_stroke_state *stroke,
+                              fz_matrix ctm, fz_colorspace *cs,
+                              const float *color, float alpha,
+                              fz_color_params cp)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashStroke);
+    hashpath (ctx, hdev, path);
+    hashstroke (hdev, stroke);
+    hashmatrix (hdev, ctm);
+    hashcolor (ctx, hdev, cs, color, alpha, cp);
+}
+
+static void hash_clip_path (fz_context *ctx, fz_device *dev,
+                            const fz_path *path, int even_odd,
+                            fz_matrix ctm, fz_rect UNUSED_ATTR scissor)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashClip);
+    hashpath (ctx, hdev, path);
+    hashint (hdev, even_odd);
+    hashmatrix (hdev, ctm);
+}
+
+static void hash_clip_stroke_path (fz_context *ctx, fz_device *dev,
+                                   const fz_path *path,
+                                   const fz_stroke_state *stroke,
+                                   fz_matrix ctm,
+                                   fz_rect UNUSED_ATTR scissor)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashClipStroke);
+    hashpath (ctx, hdev, path);
+    hashstroke (hdev, stroke);
+    hashmatrix (hdev, ctm);
+}
+
+static void hash_fill_text (fz_context *ctx, fz_device *dev,
+                            const fz_text *text, fz_matrix ctm,
+                            fz_colorspace *cs, const float *color,
+                            float alpha, fz_color_params cp)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashText);
+    hashtext (ctx, hdev, text);
+    hashmatrix (hdev, ctm);
+    hashcolor (ctx, hdev, cs, color, alpha, cp);
+}
+
+static void hash_stroke_text (fz_context *ctx, fz_device *dev,
+                              const fz_text *text,
+                              const fz_stroke_state *stroke,
+                              fz_matrix ctm, fz_colorspace *cs,
+                              const float *color, float alpha,
+                              fz_color_params cp)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashStrokeText);
+    hashtext (ctx, hdev, text);
+    hashstroke (hdev, stroke);
+    hashmatrix (hdev, ctm);
+    hashcolor (ctx, hdev, cs, color, alpha, cp);
+}
+
+static void hash_clip_text (fz_context *ctx, fz_device *dev,
+                            const fz_text *text, fz_matrix ctm,
+                            fz_rect UNUSED_ATTR scissor)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashClipText);
+    hashtext (ctx, hdev, text);
+    hashmatrix (hdev, ctm);
+}
+
+static void hash_clip_stroke_text (fz_context *ctx, fz_device *dev,
+                                   const fz_text *text,
+                                   const fz_stroke_state *stroke,
+                                   fz_matrix ctm,
+                                   fz_rect UNUSED_ATTR scissor)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashClipStrokeText);
+    hashtext (ctx, hdev, text);
+    hashstroke (hdev, stroke);
+    hashmatrix (hdev, ctm);
+}
+
+static void hash_fill_shade (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                             fz_shade UNUSED_ATTR *shade,
+                             fz_matrix UNUSED_ATTR ctm,
+                             float UNUSED_ATTR alpha,
+                             fz_color_params UNUSED_ATTR cp)
+{
+    ((struct hashdev *) dev)->failed = 1;
+}
+
+static void hash_fill_image (fz_context *ctx, fz_device *dev,
+                             fz_image *image, fz_matrix ctm, float alpha,
+                             fz_color_params cp)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashImage);
+    hashimage (ctx, hdev, image);
+    hashmatrix (hdev, ctm);
+    hashcolor (ctx, hdev, NULL, NULL, alpha, cp);
+}
+
+static void hash_fill_image_mask (fz_context *ctx, fz_device *dev,
+                                  fz_image *image, fz_matrix ctm,
+                                  fz_colorspace *cs, const float *color,
+                                  float alpha, fz_color_params cp)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashImageMask);
+    hashimage (ctx, hdev, image);
+    hashmatrix (hdev, ctm);
+    hashcolor (ctx, hdev, cs, color, alpha, cp);
+}
+
+static void hash_clip_image_mask (fz_context *ctx, fz_device *dev,
+                                  fz_image *image, fz_matrix ctm,
+                                  fz_rect UNUSED_ATTR scissor)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashClipImageMask);
+    hashimage (ctx, hdev, image);
+    hashmatrix (hdev, ctm);
+}
+
+static void hash_pop_clip (fz_context UNUSED_ATTR *ctx, fz_device *dev)
+{
+    hashint ((struct hashdev *) dev, HashPopClip);
+}
+
+static void hash_begin_mask (fz_context *ctx, fz_device *dev,
+                             fz_rect area, int luminosity,
+                             fz_colorspace *cs, const float *bc,
+                             fz_color_params cp)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+
+    hashint (hdev, HashMask);
+    hashrect (hdev, area);
+    hashint (hdev, luminosity);
+    hashcolor (ctx, hdev, cs, bc, 1, cp);
+}
+
+static void hash_end_mask (fz_context UNUSED_ATTR *ctx, fz_device *dev)
+{
+    hashint ((struct hashdev *) dev, HashEndMask);
+}
+
+static void hash_begin_group (fz_context *ctx, fz_device *dev,
+                              fz_rect area, fz_colorspace *cs,
+                              int isolated, int knockout,
+                              int blendmode, float alpha)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+    int flags[3] = { isolated, knockout, blendmode };
+
+    hashint (hdev, HashGroup);
+    hashrect (hdev, area);
+    hashbytes (hdev, flags, sizeof (flags));
+    hashcolor (ctx, hdev, cs, NULL, alpha, fz_default_color_params);
+}
+
+static void hash_end_group (fz_context UNUSED_ATTR *ctx, fz_device *dev)
+{
+    hashint ((struct hashdev *) dev, HashEndGroup);
+}
+
+static int hash_begin_tile (fz_context UNUSED_ATTR *ctx, fz_device *dev,
+                            fz_rect area, fz_rect view,
+                            float xstep, float ystep,
+                            fz_matrix ctm, int UNUSED_ATTR id)
+{
+    struct hashdev *hdev = (struct hashdev *) dev;
+    float steps[2] = { xstep, ystep };
+
+    hashint (hdev, HashTile);
+    hashrect (hdev, area);
+    hashrect (hdev, view);
+    hashfloats (hdev, steps, 2);
+    hashmatrix (hdev, ctm);
+    return 0;
+}
+
+static void hash_end_tile (fz_context UNUSED_ATTR *ctx, fz_device *dev)
+{
+    hashint ((struct hashdev *) dev, HashEndTile);
+}
+
+/* pages only share tiles with pages of the same dimensions, so the
+   page dimension entry goes into the digest too; zero means none */
+static uint64_t fingerprint (fz_context *ctx, fz_display_list *dlist,
+                             int pindex)
+{
+    uint64_t hash = 0;
+    struct hashdev *hdev = NULL;
+
+    fz_var (hdev);
+    fz_var (hash);
+    fz_try (ctx) {
+        hdev = fz_new_derived_device (ctx, struct hashdev);
+        hdev->super.fill_path = hash_fill_path;
+        hdev->super.stroke_path = hash_stroke_path;
+        hdev->super.clip_path = hash_clip_path;
+        hdev->super.clip_stroke_path = hash_clip_stroke_path;
+        hdev->super.fill_text = hash_fill_text;
+        hdev->super.stroke_text = hash_stroke_text;
+        hdev->super.clip_text = hash_clip_text;
+        hdev->super.clip_stroke_text = hash_clip_stroke_text;
+        hdev->super.fill_shade = hash_fill_shade;
+        hdev->super.fill_image = hash_fill_image;
+        hdev->super.fill_image_mask = hash_fill_image_mask;
+        hdev->super.clip_image_mask = hash_clip_image_mask;
+        hdev->super.pop_clip = hash_pop_clip;
+        hdev->super.begin_mask = hash_begin_mask;
+        hdev->super.end_mask = hash_end_mask;
+        hdev->super.begin_group = hash_begin_group;
+        hdev->super.end_group = hash_end_group;
+        hdev->super.begin_tile = hash_begin_tile;
+        hdev->super.end_tile = hash_end_tile;
+        hdev->hash = 0xcbf29ce484222325ull;
+        hashint (hdev, pindex);
+        fz_run_display_list (ctx, dlist, &hdev->super, fz_identity,
+                             fz_infinite_rect, NULL);
+        fz_close_device (ctx, &hdev->super);
+        if (!hdev->failed) {
+            hash = hdev->hash;
+        }
+    }
+    fz_always (ctx) {
+        fz_drop_device (ctx, (fz_device *) hdev);
+    }
+    fz_catch (ctx) {
+        hash = 0;
+    }
+    return hash;
+}
+
+/* must be called with the document locked */
+static void *loadpage (fz_context *ctx, int pageno, int pindex,
+                       fz_cookie *cookie)
+{
+    fz_device *dev;
+    struct page *page;
+
+    page = calloc (sizeof (struct page), 1);
+    if (!page) {
+        err (1, errno, "calloc page %d", pageno);
+    }
+
+    page->dlist = fz_new_display_list (ctx, fz_infinite_rect);
+    dev = fz_new_list_device (ctx, page->dlist);
+    fz_try (ctx) {
+        pdf_page *pdfpage;
+        fz_rect mediabox;
+
+        page->fzpage = fz_load_page (ctx, state.doc, pageno);
+        pdfpage = pdf_page_from_fz_page (ctx, page->fzpage);
+        if (pdfpage) {
+            pdf_page_transform (ctx, pdfpage, &mediabox, &page->pdfctm);
+            page->pdf = 1;
+        }
+        fz_run_page (ctx, page->fzpage, dev, fz_identity, cookie);
+    }
+    fz_catch (ctx) {
+        if (!cookie || !cookie->abort) {
+            page->fzpage = NULL;
+        }
+    }
+    fz_close_device (ctx, dev);
+    fz_drop_device (ctx, dev);
+
+    /* a partial display list is of no use to anyone */
+    if (cookie && cookie->abort) {
+        fz_drop_page (ctx, page->fzpage);
+        fz_drop_display_list (ctx, page->dlist);
+        free (page);
+        return NULL;
+    }
+
+    page->pdimno = pindex;
+    page->pageno = pageno;
+    page->sgen = state.gen;
+    page->agen = state.gen;
+    page->tgen = state.gen;
+    page->ctm = fz_identity;
+    pthread_mutex_init (&page->mutex, NULL);
+    return page;
+}
+
+/* Very busy pages can have their display list split into buckets,
+   one per tile cell: the list is replayed once through a device that
+   files every item into the lists of the cells its bounds touch, and
+   tiles then only walk what can show up in them.  Bucket lists are
+   recorded in device space and depend on the layout generation */
+struct bucketdev {
+    fz_device super;
+    int count, cols, rows, tiledepth;
+    float w, h;
+    fz_rect area, tilearea;
+    fz_device **devs;
+};
+
+/* the cells are a grid, those an item touches are the columns and
+   rows its bounds span; returns the first of them, or -1 */
+static int firstcell (struct bucketdev *bdev, fz_rect bbox, fz_irect *cells)
+{
+    /* inside patterns the items are in pattern space, go by the
+       area of the outermost one instead */
+    if (bdev->tiledepth) {
+        bbox = bdev->tilearea;
+    }
+    bbox = fz_intersect_rect (bbox, bdev->area);
+    if (fz_is_empty_rect (bbox)) {
+        return -1;
+    }
+    cells->x0 = (int) ((bbox.x0 - bdev->area.x0) / bdev->w);
+    cells->y0 = (int) ((bbox.y0 - bdev->area.y0) / bdev->h);
+    cells->x1 = fz_mini ((int) ceilf ((bbox.x1 - bdev->area.x0) / bdev->w),
+                         bdev->cols);
+    cells->y1 = fz_mini ((int) ceilf ((bbox.y1 - bdev->area.y0) / bdev->h),
+                         bdev->rows);
+    return cells->y0 * bdev->cols + cells->x0;
+}
+
+static int nextcell (struct bucketdev *bdev, fz_irect *cells, int i)
+{
+    int col = i % bdev->cols + 1, row = i / bdev->cols;
+
+    if (col == cells->x1) {
+        col = cells->x0;
+        row++;
+    }
+    return row < cells->y1 ? row * bdev->cols + col : -1;
+}
+
+static void bucket_fill_path (fz_context *ctx, fz_device *dev,
+                              const fz_path *path, int even_odd,
+                              fz_matrix ctm, fz_colorspace *cs,
+                              const float *color, float alpha,
+                              fz_color_params cp)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+    fz_rect bbox = fz_bound_path (ctx, path, NULL, ctm);
+    fz_irect cells;
+
+    for (int i = firstcell (bdev, bbox, &cells); i >= 0;
+         i = nextcell (bdev, &cells, i)) {
+        fz_fill_path (ctx, bdev->devs[i], path, even_odd, ctm,
+                      cs, color, alpha, cp);
+    }
+}
+
+static void bucket_stroke_path (fz_context *ctx, fz_device *dev,
+                                const fz_path *path,
+                                const fz_stroke_state *stroke,
+                                fz_matrix ctm, fz_colorspace *cs,
+                                const float *color, float alpha,
+                                fz_color_params cp)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+    fz_rect bbox = fz_bound_path (ctx, path, stroke, ctm);
+    fz_irect cells;
+
+    for (int i = firstcell (bdev, bbox, &cells); i >= 0;
+         i = nextcell (bdev, &cells, i)) {
+        fz_stroke_path (ctx, bdev->devs[i], path, stroke, ctm,
+                        cs, color, alpha, cp);
+    }
+}
+
+static void bucket_fill_text (fz_context *ctx, fz_device *dev,
+                              const fz_text *text, fz_matrix ctm,
+                              fz_colorspace *cs, const float *color,
+                              float alpha, fz_color_params cp)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+    fz_rect bbox = fz_bound_text (ctx, text, NULL, ctm);
+    fz_irect cells;
+
+    for (int i = firstcell (bdev, bbox, &cells); i >= 0;
+         i = nextcell (bdev, &cells, i)) {
+        fz_fill_text (ctx, bdev->devs[i], text, ctm,
+                      cs, color, alpha, cp);
+    }
+}
+
+static void bucket_stroke_text (fz_context *ctx, fz_device *dev,
+                                const fz_text *text,
+                                const fz_stroke_state *stroke,
+                                fz_matrix ctm, fz_colorspace *cs,
+                                const float *color, float alpha,
+                                fz_color_params cp)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+    fz_rect bbox = fz_bound_text (ctx, text, stroke, ctm);
+    fz_irect cells;
+
+    for (int i = firstcell (bdev, bbox, &cells); i >= 0;
+         i = nextcell (bdev, &cells, i)) {
+        fz_stroke_text (ctx, bdev->devs[i], text, stroke, ctm,
+                        cs, color, alpha, cp);
+    }
+}
+
+static void bucket_fill_shade (fz_context *ctx, fz_device *dev,
+                               fz_shade *shade, fz_matrix ctm,
+                               float alpha, fz_color_params cp)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+    fz_rect bbox = fz_bound_shade (ctx, shade, ctm);
+    fz_irect cells;
+
+    for (int i = firstcell (bdev, bbox, &cells); i >= 0;
+         i = nextcell (bdev, &cells, i)) {
+        fz_fill_shade (ctx, bdev->devs[i], shade, ctm, alpha, cp);
+    }
+}
+
+static void bucket_fill_image (fz_context *ctx, fz_device *dev,
+                               fz_image *image, fz_matrix ctm,
+                               float alpha, fz_color_params cp)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+    fz_rect bbox = fz_transform_rect (fz_unit_rect, ctm);
+    fz_irect cells;
+
+    for (int i = firstcell (bdev, bbox, &cells); i >= 0;
+         i = nextcell (bdev, &cells, i)) {
+        fz_fill_image (ctx, bdev->devs[i], image, ctm, alpha, cp);
+    }
+}
+
+static void bucket_fill_image_mask (fz_context *ctx, fz_device *dev,
+                                    fz_image *image, fz_matrix ctm,
+                                    fz_colorspace *cs, const float *color,
+                                    float alpha, fz_color_params cp)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+    fz_rect bbox = fz_transform_rect (fz_unit_rect, ctm);
+    fz_irect cells;
+
+    for (int i = firstcell (bdev, bbox, &cells); i >= 0;
+         i = nextcell (bdev, &cells, i)) {
+        fz_fill_image_mask (ctx, bdev->devs[i], image, ctm,
+                            cs, color, alpha, cp);
+    }
+}
+
+/* clips, masks and groups nest, every bucket gets all of them */
+static void bucket_clip_path (fz_context *ctx, fz_device *dev,
+                              const fz_path *path, int even_odd,
+                              fz_matrix ctm, fz_rect scissor)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_clip_path (ctx, bdev->devs[i], path, even_odd, ctm, scissor);
+    }
+}
+
+static void bucket_clip_stroke_path (fz_context *ctx, fz_device *dev,
+                                     const fz_path *path,
+                                     const fz_stroke_state *stroke,
+                                     fz_matrix ctm, fz_rect scissor)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_clip_stroke_path (ctx, bdev->devs[i], path, stroke, ctm, scissor);
+    }
+}
+
+static void bucket_clip_text (fz_context *ctx, fz_device *dev,
+                              const fz_text *text, fz_matrix ctm,
+                              fz_rect scissor)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_clip_text (ctx, bdev->devs[i], text, ctm, scissor);
+    }
+}
+
+static void bucket_clip_stroke_text (fz_context *ctx, fz_device *dev,
+                                     const fz_text *text,
+                                     const fz_stroke_state *stroke,
+                                     fz_matrix ctm, fz_rect scissor)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_clip_stroke_text (ctx, bdev->devs[i], text, stroke, ctm, scissor);
+    }
+}
+
+static void bucket_clip_image_mask (fz_context *ctx, fz_device *dev,
+                                    fz_image *image, fz_matrix ctm,
+                                    fz_rect scissor)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_clip_image_mask (ctx, bdev->devs[i], image, ctm, scissor);
+    }
+}
+
+static void bucket_pop_clip (fz_context *ctx, fz_device *dev)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_pop_clip (ctx, bdev->devs[i]);
+    }
+}
+
+static void bucket_begin_mask (fz_context *ctx, fz_device *dev,
+                               fz_rect area, int luminosity,
+                               fz_colorspace *cs, const float *bc,
+                               fz_color_params cp)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_begin_mask (ctx, bdev->devs[i], area, luminosity, cs, bc, cp);
+    }
+}
+
+static void bucket_end_mask (fz_context *ctx, fz_device *dev)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_end_mask (ctx, bdev->devs[i]);
+    }
+}
+
+static void bucket_begin_group (fz_context *ctx, fz_device *dev,
+                                fz_rect area, fz_colorspace *cs,
+                                int isolated, int knockout,
+                                int blendmode, float alpha)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_begin_group (ctx, bdev->devs[i], area, cs,
+                        isolated, knockout, blendmode, alpha);
+    }
+}
+
+static void bucket_end_group (fz_context *ctx, fz_device *dev)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_end_group (ctx, bdev->devs[i]);
+    }
+}
+
+static int bucket_begin_tile (fz_context *ctx, fz_device *dev,
+                              fz_rect area, fz_rect view,
+                              float xstep, float ystep,
+                              fz_matrix ctm, int id)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    if (bdev->tiledepth++ == 0) {
+        bdev->tilearea = fz_transform_rect (area, ctm);
+    }
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_begin_tile_id (ctx, bdev->devs[i], area, view,
+                          xstep, ystep, ctm, id);
+    }
+    /* the content is always wanted, it is split as it goes by */
+    return 0;
+}
+
+static void bucket_end_tile (fz_context *ctx, fz_device *dev)
+{
+    struct bucketdev *bdev = (struct bucketdev *) dev;
+
+    bdev->tiledepth--;
+    for (int i = 0; i < bdev->count; ++i) {
+        fz_end_tile (ctx, bdev->devs[i]);
+    }
+}
+
+/* runs on a worker, tiles of the page walk the whole display list
+   until it is done */
+static void fillbuckets (fz_context *ctx, struct renderjob *job)
+{
+    struct buckets *buckets = job->buckets;
+    struct bucketdev *bdev = NULL;
+    int count = buckets->cols * buckets->rows, ok = 0;
+
+    fz_var (bdev);
+    fz_var (ok);
+    fz_try (ctx) {
+        bdev = fz_new_derived_device (ctx, struct bucketdev);
+        bdev->super.fill_path = bucket_fill_path;
+        bdev->super.stroke_path = bucket_stroke_path;
+        bdev->super.clip_path = bucket_clip_path;
+        bdev->super.clip_stroke_path = bucket_clip_stroke_path;
+        bdev->super.fill_text = bucket_fill_text;
+        bdev->super.stroke_text = bucket_stroke_text;
+        bdev->super.clip_text = bucket_clip_text;
+        bdev->super.clip_stroke_text = bucket_clip_stroke_text;
+        bdev->super.fill_shade = bucket_fill_shade;
+        bdev->super.fill_image = bucket_fill_image;
+        bdev->super.fill_image_mask = bucket_fill_image_mask;
+        bdev->super.clip_image_mask = bucket_clip_image_mask;
+        bdev->super.pop_clip = bucket_pop_clip;
+        bdev->super.begin_mask = bucket_begin_mask;
+        bdev->super.end_mask = bucket_end_mask;
+        bdev->super.begin_group = bucket_begin_group;
+        bdev->super.end_group = bucket_end_group;
+        bdev->super.begin_tile = bucket_begin_tile;
+        bdev->super.end_tile = bucket_end_tile;
+
+        bdev->cols = buckets->cols;
+        bdev->rows = buckets->rows;
+        bdev->w = buckets->w;
+        bdev->h = buckets->h;
+        bdev->area = fz_rect_from_irect (buckets->bounds);
+        bdev->devs = fz_calloc (ctx, count, sizeof (*bdev->devs));
+        for (int i = 0; i < count; ++i) {
+            fz_irect r;
+
+            r.x0 = buckets->bounds.x0 + (i % buckets->cols) * buckets->w;
+            r.y0 = buckets->bounds.y0 + (i / buckets->cols) * buckets->h;
+            r.x1 = fz_mini (r.x0 + buckets->w, buckets->bounds.x1);
+            r.y1 = fz_mini (r.y0 + buckets->h, buckets->bounds.y1);
+            buckets->lists[i] = fz_new_display_list (ctx,
+                                                     fz_rect_from_irect (r));
+            bdev->devs[i] = fz_new_list_device (ctx, buckets->lists[i]);
+            bdev->count = i + 1;
+        }
+        fz_run_display_list (ctx, job->dlist, &bdev->super, job->ctm,
+                             fz_infinite_rect, &buckets->cookie);
+        fz_close_device (ctx, &bdev->super);
+        for (int i = 0; i < count; ++i) {
+            fz_close_device (ctx, bdev->devs[i]);
+        }
+        ok = !buckets->cookie.abort;
+    }
+    fz_always (ctx) {
+        if (bdev) {
+            for (int i = 0; i < bdev->count; ++i) {
+                fz_drop_device (ctx, bdev->devs[i]);
+            }
+            fz_free (ctx, bdev->devs);
+            fz_drop_device (ctx, &bdev->super);
+        }
+    }
+    fz_catch (ctx) {
+        if (!buckets->cookie.abort) {
+            printd ("emsg failed to bucket page %d: %s",
+                    job->pageno, fz_caught_message (ctx));
+        }
+    }
+    lockmutex (&state.pool.mutex, "fillbuckets");
+    buckets->ready = ok ? 1 : -1;
+    unlockmutex (&state.pool.mutex, "fillbuckets");
+}
+
+static struct tile *alloctile (int h)
+{
+    static unsigned long serial;
+    int slicecount;
+    size_t tilesize;
+    struct tile *tile;
+
+    slicecount = (h + state.sliceheight - 1) / state.sliceheight;
+    tilesize = sizeof (*tile) + ((slicecount - 1) * sizeof (struct slice));
+    tile = calloc (tilesize, 1);
+    if (!tile) {
+        err (1, errno, "cannot allocate tile (%zu bytes)", tilesize);
+    }
+    for (int i = 0; i < slicecount; ++i) {
+        int sh = fz_mini (h, state.sliceheight);
+        tile->slices[i].h = sh;
+        tile->slices[i].texindex = -1;
+        h -= sh;
+    }
+    tile->slicecount = slicecount;
+    tile->sliceheight = state.sliceheight;
+    tile->scale = 1;
+    tile->serial = ++serial;
+    return tile;
+}
+
+static fz_pixmap *getpixmap (fz_irect bbox)
+{
+    fz_pixmap *pixmap = NULL;
+    int w = bbox.x1 - bbox.x0, h = bbox.y1 - bbox.y0;
+
+    lockmutex (&state.pool.mutex, "getpixmap");
+    for (int i = 0; i < state.pigs.count; ++i) {
+        fz_pixmap *pig = state.pigs.slots[i];
+
+        if (pig->w == w
+            && pig->h == h
+            && pig->colorspace == state.colorspace
+            && pig->alpha == state.alpha) {
+            pixmap = pig;
+            pixmap->x = bbox.x0;
+            pixmap->y = bbox.y0;
+            state.pigs.bytes -= pigbytes (pixmap);
+            state.pigs.count--;
+            memmove (&state.pigs.slots[i], &state.pigs.slots[i + 1],
+                     (state.pigs.count - i) * sizeof (*state.pigs.slots));
+            break;
+        }
+    }
+
+    if (pixmap) {
+        state.pool.pighits++;
+    }
+    else {
+        state.pool.pigmisses++;
+    }
+    unlockmutex (&state.pool.mutex, "getpixmap");
+    if (!pixmap) {
+        pixmap = fz_new_pixmap_with_bbox (state.cmdctx, state.colorspace,
+                                          bbox, NULL, state.alpha);
+    }
+    return pixmap;
+}
+
+/* the pixmap of a blank tile is traded for its color, as RGBA */
+static void makesolid (fz_context *ctx, struct tile *tile)
+{
+    fz_pixmap *pixmap = tile->pixmap;
+    const unsigned char *s = pixmap->samples;
+    int gray = pixmap->n - pixmap->alpha == 1;
+
+    tile->color[0] = s[0];
+    tile->color[1] = s[gray ? 0 : 1];
+    tile->color[2] = s[gray ? 0 : 2];
+    tile->color[3] = pixmap->alpha ? s[pixmap->n - 1] : 255;
+    tile->solid = 1;
+    tile->pixmap = NULL;
+    fz_drop_pixmap (ctx, pixmap);
+}
+
+static int uniform (fz_pixmap *pixmap)
+{
+    int n = pixmap->n;
+    const unsigned char *row = pixmap->samples;
+
+    for (int x = 1; x < pixmap->w; ++x) {
+        if (memcmp (row + x * n, row, n)) {
+            return 0;
+        }
+    }
+    for (int y = 1; y < pixmap->h; ++y) {
+        if (memcmp (row + y * pixmap->stride, row, (size_t) pixmap->w * n)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* text is mostly black on white even when rendered in color */
+static int grayish (fz_pixmap *pixmap)
+{
+    int n = pixmap->n, rgb = n - pixmap->alpha == 3;
+
+    for (int y = 0; y < pixmap->h; ++y) {
+        const unsigned char *s = pixmap->samples + y * pixmap->stride;
+
+        for (int x = 0; x < pixmap->w; ++x, s += n) {
+            if ((rgb && (s[0] != s[1] || s[0] != s[2]))
+                || (pixmap->alpha && s[n - 1] != 255)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void graytile (fz_context *ctx, struct tile *tile)
+{
+    fz_pixmap *src = tile->pixmap, *dst = NULL;
+
+    fz_var (dst);
+    fz_try (ctx) {
+        dst = fz_new_pixmap_with_bbox (ctx, fz_device_gray (ctx),
+                                       fz_pixmap_bbox (ctx, src), NULL, 0);
+    }
+    fz_catch (ctx) {
+        return;
+    }
+    for (int y = 0; y < src->h; ++y) {
+        const unsigned char *s = src->samples + y * src->stride;
+        unsigned char *d = dst->samples + y * dst->stride;
+
+        for (int x = 0; x < src->w; ++x) {
+            d[x] = s[x * src->n];
+        }
+    }
+    tile->pixmap = dst;
+    putpig (ctx, src);
+}
+
+static int blanktile (struct page *page, int x, int y, int w, int h)
+{
+    fz_irect bbox, content;
+
+    bbox = state.pagedims[page->pdimno].bounds;
+    bbox.x0 += x;
+    bbox.y0 += y;
+    bbox.x1 = bbox.x0 + w;
+    bbox.y1 = bbox.y0 + h;
+    content = fz_round_rect (fz_transform_rect (page->contentbox,
+                                                pagectm (page)));
+    return fz_is_empty_irect (fz_intersect_irect (content, bbox));
+}
+
+static int bakechannel (int c, int n, int alpha)
+{
+    if (alpha && c == n - 1) {
+        return -1;
+    }
+    return n - alpha == 1 ? 3 : c;
+}
+
+static void bakescalar (const struct bake *bake, unsigned char *p,
+                        int len, int n, int alpha, int c)
+{
+    for (int i = 0; i < len; ++i, c = c + 1 == n ? 0 : c + 1) {
+        int ch = bakechannel (c, n, alpha);
+
+        if (ch >= 0) {
+            p[i] = bake->lut[ch][p[i]];
+        }
+    }
+}
+
+#ifdef __SSE2__
+/* n divides 8: the channel pattern of the low and the high half of
+   every 16 bytes is the same */
+static int bakesse2 (const struct bake *bake, unsigned char *p,
+                     int len, int n, int alpha)
+{
+    short mul[8], add[8];
+    __m128i vmul, vadd, zero = _mm_setzero_si128 ();
+    int i;
+
+    for (int j = 0; j < 8; ++j) {
+        int ch = bakechannel (j % n, n, alpha);
+
+        mul[j] = ch < 0 ? 128 : bake->mul[ch];
+        add[j] = ch < 0 ? 0 : bake->add[ch];
+    }
+    vmul = _mm_loadu_si128 ((__m128i *) mul);
+    vadd = _mm_loadu_si128 ((__m128i *) add);
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128 ((__m128i *) (p + i));
+        __m128i lo = _mm_unpacklo_epi8 (v, zero);
+        __m128i hi = _mm_unpackhi_epi8 (v, zero);
+
+        lo = _mm_add_epi16 (vadd, _mm_srai_epi16 (_mm_mullo_epi16 (lo, vmul), 7));
+        hi = _mm_add_epi16 (vadd, _mm_srai_epi16 (_mm_mullo_epi16 (hi, vmul), 7));
+        _mm_storeu_si128 ((__m128i *) (p + i), _mm_packus_epi16 (lo, hi));
+    }
+    return i;
+}
+#endif
+
+static void bakepixmap (const struct bake *bake, fz_pixmap *pixmap)
+{
+    int n = pixmap->n;
+    int len = pixmap->w * n;
+    unsigned char *row = pixmap->samples;
+
+    for (int y = 0; y < pixmap->h; ++y, row += pixmap->stride) {
+        int done = 0;
+
+#ifdef __SSE2__
+        if (bake->affine && 8 % n == 0) {
+            done = bakesse2 (bake, row, len, n, pixmap->alpha);
+        }
+#endif
+        bakescalar (bake, row + done, len - done, n, pixmap->alpha, done % n);
+    }
+}
+
+static void bakeband (struct renderjob *job, fz_pixmap *pixmap)
+{
+    double start;
+
+    if (!job->bake.active) {
+        return;
+    }
+    start = now ();
+    bakepixmap (&job->bake, pixmap);
+
+    lockmutex (&state.pool.mutex, "bakeband");
+    state.pool.bakes++;
+    state.pool.baketime += now () - start;
+    unlockmutex (&state.pool.mutex, "bakeband");
+}
+
+/* replies right away with a solid tile of paper color */
+static void papertile (int id, int x, int y, struct tile *tile)
+{
+    float papercolor[4];
+
+    lockmutex (&state.pool.mutex, "papertile");
+    memcpy (papercolor, state.papercolor, sizeof (papercolor));
+    unlockmutex (&state.pool.mutex, "papertile");
+
+    tile->pixmap = fz_new_pixmap (state.cmdctx, state.colorspace, 1, 1,
+                                  NULL, state.alpha);
+    fz_fill_pixmap_with_color (state.cmdctx, tile->pixmap,
+                               fz_device_rgb (state.cmdctx), papercolor,
+                               fz_default_color_params);
+    lockmutex (&state.pool.mutex, "papertile");
+    if (state.bake.active) {
+        bakepixmap (&state.bake, tile->pixmap);
+    }
+    state.pool.blanktiles++;
+    unlockmutex (&state.pool.mutex, "papertile");
+    makesolid (state.cmdctx, tile);
+    printd ("tile %d %d %d %" PRIxPTR " 0 0.0",
+            id, x, y, (uintptr_t) tile);
+}
+
+/* Tiles are cut into horizontal bands (made of whole slices) and the
+   bands are rasterized by the render pool in parallel, every worker
+   using its own clone of the context and only touching the (shared,
+   reference counted) display list and its part of the pixmap.
+
+   Queued tiles are kept ordered by the priority the UI assigned to
+   them (lower is more urgent, FIFO among equals) */
+static void enqueuejob (struct renderjob *job)
+{
+    struct renderjob **pp = &state.pool.head;
+
+    while (*pp && (*pp)->prio <= job->prio) {
+        pp = &(*pp)->next;
+    }
+    job->next = *pp;
+    *pp = job;
+}
+
+/* render quality profiles, in the order of the UI's quality type:
+   the views that are in motion get drafts, without antialiasing,
+   image smoothing and color management, that are redone at the
+   settled profile once they stop */
+enum { QualityDraft, QualityBalanced, QualityExact };
+
+static int qualityaa (int quality)
+{
+    switch (quality) {
+    case QualityDraft: return 0;
+    case QualityBalanced: return fz_mini (state.aalevel, 4);
+    default: return state.aalevel;
+    }
+}
+
+static struct renderjob *newjob (int id, int prio, struct page *page,
+                                 struct tile *tile, fz_irect bbox,
+                                 int bandcount, int quality)
+{
+    size_t jobsize;
+    int slicesperband;
+    struct renderjob *job;
+
+    bandcount = fz_mini (bandcount, tile->slicecount);
+    slicesperband = (tile->slicecount + bandcount - 1) / bandcount;
+    bandcount = (tile->slicecount + slicesperband - 1) / slicesperband;
+
+    jobsize = sizeof (*job) + bandcount * sizeof (struct band);
+    job = calloc (jobsize, 1);
+    if (!job) {
+        err (1, errno, "cannot allocate render job (%zu bytes)", jobsize);
+    }
+    job->id = id;
+    job->x = bbox.x0 - state.pagedims[page->pdimno].bounds.x0;
+    job->y = bbox.y0 - state.pagedims[page->pdimno].bounds.y0;
+    job->pageno = page->pageno;
+    job->prio = prio;
+    job->scale = 1;
+    job->tile = tile;
+    job->quality = quality;
+    job->aalevel = qualityaa (quality);
+    job->bandcount = bandcount;
+    job->bandsleft = bandcount;
+    job->ctm = pagectm (page);
+    job->dlist = fz_keep_display_list (state.cmdctx, page->dlist);
+    job->imagecache = keepimagecache (page->imagecache);
+    job->gen = state.gen;
+    lockmutex (&state.pool.mutex, "newjob");
+    memcpy (job->papercolor, state.papercolor, sizeof (job->papercolor));
+    job->bake = state.bake;
+    unlockmutex (&state.pool.mutex, "newjob");
+
+    for (int i = 0; i < bandcount; ++i) {
+        struct band *band = &job->bands[i];
+
+        band->job = job;
+        band->rect = bbox;
+        band->rect.y0 = bbox.y0 + i * slicesperband * tile->sliceheight;
+        band->rect.y1 = fz_mini (bbox.y1, band->rect.y0
+                                 + slicesperband * tile->sliceheight);
+    }
+    return job;
+}
+
+static void usebucket (struct renderjob *job, fz_display_list *list)
+{
+    fz_drop_display_list (state.cmdctx, job->dlist);
+    job->dlist = fz_keep_display_list (state.cmdctx, list);
+    job->ctm = fz_identity;
+    job->bucketed = 1;
+}
+
+/* a pass over the whole page is too long to keep the command thread
+   waiting, the buckets are filled by the pool */
+static struct buckets *queuebuckets (int prio, struct page *page,
+                                     int w, int h)
+{
+    size_t size;
+    fz_irect bounds;
+    struct buckets *buckets;
+    struct renderjob *job;
+    int cols, rows;
+
+    bounds = state.pagedims[page->pdimno].bounds;
+    cols = (bounds.x1 - bounds.x0 + w - 1) / w;
+    rows = (bounds.y1 - bounds.y0 + h - 1) / h;
+    size = sizeof (*buckets) + cols * rows * sizeof (fz_display_list *);
+    buckets = calloc (size, 1);
+    if (!buckets) {
+        err (1, errno, "calloc buckets %zu", size);
+    }
+    buckets->gen = state.gen;
+    buckets->w = w;
+    buckets->h = h;
+    buckets->cols = cols;
+    buckets->rows = rows;
+    buckets->bounds = bounds;
+    buckets->refs = 2;
+
+    size = sizeof (*job) + sizeof (struct band);
+    job = calloc (size, 1);
+    if (!job) {
+        err (1, errno, "cannot allocate bucket job (%zu bytes)", size);
+    }
+    job->kind = JobBuckets;
+    job->prio = prio;
+    job->pageno = page->pageno;
+    job->scale = 1;
+    job->bandcount = 1;
+    job->bandsleft = 1;
+    job->bands[0].job = job;
+    job->ctm = pagectm (page);
+    job->dlist = fz_keep_display_list (state.cmdctx, page->dlist);
+    job->buckets = buckets;
+
+    lockmutex (&state.pool.mutex, "queuebuckets");
+    enqueuejob (job);
+    state.pool.queued++;
+    state.pool.pending++;
+    pthread_cond_broadcast (&state.pool.cond);
+    unlockmutex (&state.pool.mutex, "queuebuckets");
+    return buckets;
+}
+
+/* the bucket of the tile at x, y (if bucketing is on, the tile is one
+   of the cells and the buckets are filled) */
+static fz_display_list *tilelist (int prio, struct page *page,
+                                  int x, int y, int w, int h)
+{
+    struct buckets *buckets = page->buckets;
+    int bw, bh, ready;
+
+    lockmutex (&state.pool.mutex, "tilelist");
+    bw = state.bucketw;
+    bh = state.bucketh;
+    ready = buckets ? buckets->ready : 0;
+    unlockmutex (&state.pool.mutex, "tilelist");
+    if (!bw || !bh || x % bw || y % bh || w > bw || h > bh) {
+        return NULL;
+    }
+    if (!buckets
+        || buckets->gen != state.gen
+        || buckets->w != bw
+        || buckets->h != bh) {
+        dropbuckets (state.cmdctx, buckets);
+        page->buckets = queuebuckets (prio, page, bw, bh);
+        return NULL;
+    }
+    if (ready <= 0) {
+        return NULL;
+    }
+    return buckets->lists[(y / buckets->h) * buckets->cols + x / buckets->w];
+}
+
+/* tiles of a page that went over the time budget last time around
+   are preceded by a cheap, coarse preview of the same area, and so
+   are visible tiles when the UI asks for progressive refinement */
+static int overbudget (int pageno)
+{
+    int over;
+
+    lockmutex (&state.pool.mutex, "overbudget");
+    over = state.pool.budget > 0.0
+        && state.pool.pagecost
+        && state.pool.pagecost[pageno] > state.pool.budget;
+    unlockmutex (&state.pool.mutex, "overbudget");
+    return over;
+}
+
+/* previews are kept at their reduced size, drawtile stretches them */
+static struct tile *previewtile (fz_irect bbox)
+{
+    fz_irect sbbox;
+    struct tile *tile;
+
+    sbbox = fz_round_rect (
+        fz_transform_rect (fz_rect_from_irect (bbox),
+                           fz_scale (1.0f / PREVIEWSCALE,
+                                     1.0f / PREVIEWSCALE))
+        );
+    tile = alloctile (sbbox.y1 - sbbox.y0);
+    tile->w = sbbox.x1 - sbbox.x0;
+    tile->h = sbbox.y1 - sbbox.y0;
+    tile->scale = PREVIEWSCALE;
+    tile->pixmap = fz_new_pixmap_with_bbox (state.cmdctx, state.colorspace,
+                                            sbbox, NULL, state.alpha);
+    return tile;
+}
+
+static void queuetile (int id, int prio, struct page *page,
+                       int x, int y, int w, int h, int progressive,
+                       int quality)
+{
+    fz_irect bbox;
+    struct tile *tile;
+    struct pagedim *pdim;
+    fz_display_list *list;
+    struct renderjob *job, *preview = NULL;
+    int banded;
+
+    tile = alloctile (h);
+    tile->w = w;
+    tile->h = h;
+    if (blanktile (page, x, y, w, h)) {
+        papertile (id, x, y, tile);
+        return;
+    }
+    pdim = &state.pagedims[page->pdimno];
+
+    bbox = pdim->bounds;
+    bbox.x0 += x;
+    bbox.y0 += y;
+    bbox.x1 = bbox.x0 + w;
+    bbox.y1 = bbox.y0 + h;
+
+    lockmutex (&state.pool.mutex, "queuetile");
+    banded = state.bandedtiles;
+    unlockmutex (&state.pool.mutex, "queuetile");
+
+    tile->pixmap = getpixmap (bbox);
+    job = newjob (id, prio, page, tile, bbox,
+                  banded ? tile->slicecount : state.pool.count,
+                  quality);
+    list = page->imagecache ? NULL : tilelist (prio, page, x, y, w, h);
+    if (list) {
+        usebucket (job, list);
+    }
+
+    if (!page->imagecache && (progressive || overbudget (page->pageno))) {
+        preview = newjob (id, prio, page, previewtile (bbox), bbox, 1,
+                          quality);
+        preview->bands[0].rect = bbox;
+        preview->scale = PREVIEWSCALE;
+        if (list) {
+            usebucket (preview, list);
+        }
+    }
+    /* the preview covers the tile until it is complete */
+    job->banded = banded && !preview && job->bandcount > 1;
+
+    lockmutex (&state.pool.mutex, "queuetile");
+    if (preview) {
+        enqueuejob (preview);
+        state.pool.queued++;
+        state.pool.pending++;
+        state.pool.previews++;
+    }
+    enqueuejob (job);
+    state.pool.queued++;
+    state.pool.pending++;
+    pthread_cond_broadcast (&state.pool.cond);
+    unlockmutex (&state.pool.mutex, "queuetile");
+}
+
+/* a row of adjacent tiles of one page can also be rendered as a
+   single strip, walking the display list once for all of them, and
+   then be cut into the individual tiles */
+static void queuestrip (int prio, struct page *page, int y, int h,
+                        struct strip *strip, int quality)
+{
+    fz_irect bbox;
+    struct pagedim *pdim;
+    struct renderjob *job;
+
+    pdim = &state.pagedims[page->pdimno];
+    bbox = pdim->bounds;
+    bbox.y0 += y;
+    bbox.y1 = bbox.y0 + h;
+    bbox.x1 = bbox.x0;
+    bbox.x0 += strip->parts[0].x;
+
+    for (int i = 0; i < strip->count; ++i) {
+        struct strippart *part = &strip->parts[i];
+        fz_irect tbox = bbox;
+
+        tbox.x0 = pdim->bounds.x0 + part->x;
+        tbox.x1 = tbox.x0 + part->tile->w;
+        part->tile->pixmap = getpixmap (tbox);
+        bbox.x1 = fz_maxi (bbox.x1, tbox.x1);
+    }
+    strip->pixmap = fz_new_pixmap_with_bbox (state.cmdctx, state.colorspace,
+                                             bbox, NULL, state.alpha);
+
+    job = newjob (strip->parts[0].id, prio, page, strip->parts[0].tile,
+                  bbox, state.pool.count, quality);
+    job->kind = JobStrip;
+    job->strip = strip;
+    job->tile = NULL;
+
+    lockmutex (&state.pool.mutex, "queuestrip");
+    enqueuejob (job);
+    state.pool.queued++;
+    state.pool.pending++;
+    state.pool.strips++;
+    pthread_cond_broadcast (&state.pool.cond);
+    unlockmutex (&state.pool.mutex, "queuestrip");
+}
+
+static void splitstrip (struct strip *strip)
+{
+    fz_pixmap *src = strip->pixmap;
+
+    for (int i = 0; i < strip->count; ++i) {
+        fz_pixmap *dst = strip->parts[i].tile->pixmap;
+        unsigned char *s = src->samples
+            + (dst->y - src->y) * src->stride
+            + (dst->x - src->x) * src->n;
+
+        for (int y = 0; y < dst->h; ++y) {
+            memcpy (dst->samples + y * dst->stride, s, dst->w * dst->n);
+            s += src->stride;
+        }
+    }
+}
+
+/* pages are interpreted by the pool too, one at a time since the
+   document is not reentrant, but alongside the rasterization of the
+   tiles of pages that are already loaded */
+static void queuepage (int id, int prio, int pageno, int pindex)
+{
+    struct renderjob *job;
+    size_t jobsize = sizeof (*job) + sizeof (struct band);
+
+    job = calloc (jobsize, 1);
+    if (!job) {
+        err (1, errno, "cannot allocate page job (%zu bytes)", jobsize);
+    }
+    job->id = id;
+    job->kind = JobPage;
+    job->prio = prio;
+    job->pageno = pageno;
+    job->pindex = pindex;
+    job->pdimgen = state.pdimgen;
+    job->scale = 1;
+    job->bandcount = 1;
+    job->bandsleft = 1;
+    job->bands[0].job = job;
+
+    lockmutex (&state.pool.mutex, "queuepage");
+    enqueuejob (job);
+    state.pool.queued++;
+    state.pool.pending++;
+    pthread_cond_broadcast (&state.pool.cond);
+    unlockmutex (&state.pool.mutex, "queuepage");
+}
+
+/* what the pool learns about a loaded page only reads its display
+   list, so it is left out of the time the document is held */
+static void examinepage (fz_context *ctx, struct page *page)
+{
+    int share;
+
+    page->imagecache = findimage (ctx, page->dlist);
+    page->contentbox = contentbox (ctx, page->dlist);
+    lockmutex (&state.pool.mutex, "examinepage");
+    share = state.sharepages;
+    unlockmutex (&state.pool.mutex, "examinepage");
+    if (share) {
+        page->fingerprint = fingerprint (ctx, page->dlist, page->pdimno);
+    }
+}
+
+static void buildpage (fz_context *ctx, struct band *band)
+{
+    struct renderjob *job = band->job;
+
+    lock ("buildpage");
+    if (job->pdimgen == state.pdimgen) {
+        job->page = loadpage (ctx, job->pageno, job->pindex, &band->cookie);
+    }
+    unlock ("buildpage");
+    if (job->page) {
+        examinepage (ctx, job->page);
+    }
+}
+
+static fz_device *newdrawdevice (fz_context *ctx, struct renderjob *job,
+                                 fz_matrix ctm, fz_pixmap *pixmap)
+{
+    fz_device *dev;
+
+    fz_set_aa_level (ctx, job->aalevel);
+    if (job->quality == QualityExact) {
+        fz_enable_icc (ctx);
+    }
+    else {
+        fz_disable_icc (ctx);
+    }
+    dev = fz_new_draw_device (ctx, ctm, pixmap);
+    if (job->quality == QualityDraft) {
+        fz_enable_device_hints (ctx, dev, FZ_DONT_INTERPOLATE_IMAGES);
+    }
+    return dev;
+}
+
+static void renderpreview (fz_context *ctx, struct band *band)
+{
+    fz_device *dev = NULL;
+    struct renderjob *job = band->job;
+
+    fz_var (dev);
+    fz_try (ctx) {
+        fz_fill_pixmap_with_color (ctx, job->tile->pixmap, fz_device_rgb (ctx),
+                                   job->papercolor, fz_default_color_params);
+        dev = newdrawdevice (ctx, job,
+                             fz_scale (1.0f / job->scale, 1.0f / job->scale),
+                             job->tile->pixmap);
+        fz_run_display_list (ctx, job->dlist, dev, job->ctm,
+                             fz_rect_from_irect (band->rect), &band->cookie);
+        fz_close_device (ctx, dev);
+        bakeband (job, job->tile->pixmap);
+    }
+    fz_always (ctx) {
+        fz_drop_device (ctx, dev);
+    }
+    fz_catch (ctx) {
+        if (!band->cookie.abort) {
+            printd ("emsg failed to render preview: %s",
+                    fz_caught_message (ctx));
+        }
+    }
+}
+
+static fz_pixmap *jobpixmap (struct renderjob *job)
+{
+    return job->kind == JobStrip ? job->strip->pixmap : job->tile->pixmap;
+}
+
+/* the decoded image is shared by all the tiles of the page and is
+   redone only when the layout changes; it is only ever scaled down,
+   past its own resolution fz_fill_image magnifies it per tile */
+static fz_image *scaledimage (fz_context *ctx, struct renderjob *job,
+                              fz_matrix *ctm)
+{
+    fz_image *scaled = NULL;
+    fz_pixmap *pixmap = NULL, *spixmap = NULL;
+    struct imagecache *cache = job->imagecache;
+
+    *ctm = fz_concat (cache->ctm, job->ctm);
+    lockmutex (&cache->mutex, "scaledimage");
+    fz_var (pixmap);
+    fz_var (spixmap);
+    fz_try (ctx) {
+        if (!cache->scaled || cache->gen != job->gen) {
+            fz_matrix dctm = *ctm;
+            int w = (int) (hypotf (ctm->a, ctm->b) + 0.5f);
+            int h = (int) (hypotf (ctm->c, ctm->d) + 0.5f);
+
+            fz_drop_image (ctx, cache->scaled);
+            cache->scaled = NULL;
+            pixmap = fz_get_pixmap_from_image (ctx, cache->image, NULL,
+                                               &dctm, &w, &h);
+            w = fz_mini ((int) (hypotf (ctm->a, ctm->b) + 0.5f),
+                         cache->image->w);
+            h = fz_mini ((int) (hypotf (ctm->c, ctm->d) + 0.5f),
+                         cache->image->h);
+            if (pixmap->w <= w && pixmap->h <= h) {
+                spixmap = fz_keep_pixmap (ctx, pixmap);
+            }
+            else {
+                spixmap = fz_scale_pixmap (ctx, pixmap, 0, 0, w, h, NULL);
+            }
+            cache->scaled = fz_new_image_from_pixmap (ctx, spixmap, NULL);
+            cache->gen = job->gen;
+        }
+        scaled = fz_keep_image (ctx, cache->scaled);
+    }
+    fz_always (ctx) {
+        fz_drop_pixmap (ctx, spixmap);
+        fz_drop_pixmap (ctx, pixmap);
+        unlockmutex (&cache->mutex, "scaledimage");
+    }
+    fz_catch (ctx) {
+        fz_rethrow (ctx);
+    }
+    return scaled;
+}
+
+static void renderimage (fz_context *ctx, struct band *band)
+{
+    fz_matrix ctm;
+    fz_device *dev = NULL;
+    fz_image *image = NULL;
+    fz_pixmap *pixmap = NULL;
+    struct renderjob *job = band->job;
+
+    fz_var (dev);
+    fz_var (image);
+    fz_var (pixmap);
+    fz_try (ctx) {
+        image = scaledimage (ctx, job, &ctm);
+        pixmap = fz_new_pixmap_from_pixmap (ctx, jobpixmap (job),
+                                            &band->rect);
+        fz_fill_pixmap_with_color (ctx, pixmap, fz_device_rgb (ctx),
+                                   job->papercolor, fz_default_color_params);
+        dev = newdrawdevice (ctx, job, fz_identity, pixmap);
+        fz_fill_image (ctx, dev, image, ctm, 1.0f, fz_default_color_params);
+        fz_close_device (ctx, dev);
+        bakeband (job, pixmap);
+    }
+    fz_always (ctx) {
+        fz_drop_device (ctx, dev);
+        fz_drop_pixmap (ctx, pixmap);
+        fz_drop_image (ctx, image);
+    }
+    fz_catch (ctx) {
+        printd ("emsg failed to render image tile: %s",
+                fz_caught_message (ctx));
+    }
+}
+
+static void renderband (fz_context *ctx, struct band *band)
+{
+    fz_device *dev = NULL;
+    fz_pixmap *pixmap = NULL;
+    struct renderjob *job = band->job;
+
+    if (band->cookie.abort) {
+        return;
+    }
+    if (job->kind == JobPage) {
+        buildpage (ctx, band);
+        return;
+    }
+    if (job->kind == JobBuckets) {
+        fillbuckets (ctx, job);
+        return;
+    }
+    if (job->imagecache && job->scale == 1) {
+        renderimage (ctx, band);
+        return;
+    }
+    if (job->scale > 1) {
+        renderpreview (ctx, band);
+        return;
+    }
+
+    fz_var (dev);
+    fz_var (pixmap);
+    fz_try (ctx) {
+        pixmap = fz_new_pixmap_from_pixmap (ctx, jobpixmap (job),
+                                            &band->rect);
+        fz_fill_pixmap_with_color (ctx, pixmap, fz_device_rgb (ctx),
+                                   job->papercolor, fz_default_color_params);
+        dev = newdrawdevice (ctx, job, fz_identity, pixmap);
+        fz_run_display_list (ctx, job->dlist, dev, job->ctm,
+                             fz_rect_from_irect (band->rect), &band->cookie);
+        fz_close_device (ctx, dev);
+        bakeband (job, pixmap);
+    }
+    fz_always (ctx) {
+        fz_drop_device (ctx, dev);
+        fz_drop_pixmap (ctx, pixmap);
+    }
+    fz_catch (ctx) {
+        if (!band->cookie.abort) {
+            printd ("emsg failed to render tile: %s", fz_caught_message (ctx));
+        }
+    }
+}
+
+static void releasejob (fz_context *ctx, struct renderjob *job)
+{
+    dropbuckets (ctx, job->buckets);
+    dropimagecache (ctx, job->imagecache);
+    fz_drop_display_list (ctx, job->dlist);
+    free (job);
+
+    lockmutex (&state.pool.mutex, "releasejob");
+    if (--state.pool.pending == 0) {
+        trimpigs (ctx, state.pigs.limit, PIGWARM);
+        pthread_cond_broadcast (&state.pool.idle);
+    }
+    unlockmutex (&state.pool.mutex, "releasejob");
+}
+
+static void freestrip (fz_context *ctx, struct strip *strip)
+{
+    fz_drop_pixmap (ctx, strip->pixmap);
+    free (strip);
+}
+
+/* a blank tile gives up its pixmap, unless the UI might be reading
+   it already (banded delivery); returns the size left to account for */
+static unsigned int finishtile (fz_context *ctx, struct tile *tile,
+                                int scan)
+{
+    if (scan && uniform (tile->pixmap)) {
+        makesolid (ctx, tile);
+        lockmutex (&state.pool.mutex, "finishtile");
+        state.pool.blanktiles++;
+        unlockmutex (&state.pool.mutex, "finishtile");
+        return 0;
+    }
+    if (scan && tile->pixmap->n > 1 && grayish (tile->pixmap)) {
+        graytile (ctx, tile);
+        if (tile->pixmap->n == 1) {
+            lockmutex (&state.pool.mutex, "finishtile");
+            state.pool.graytiles++;
+            unlockmutex (&state.pool.mutex, "finishtile");
+        }
+    }
+    return tile->w * tile->h * tile->pixmap->n;
+}
+
+static void finishjob (fz_context *ctx, struct renderjob *job)
+{
+    struct tile *tile = job->tile;
+    double elapsed = now () - job->begin;
+
+    switch (job->kind) {
+    case JobPage:
+        if (job->page) {
+            printd ("page %d %" PRIxPTR " %f %" PRIx64,
+                    job->id, (uintptr_t) job->page, elapsed,
+                    job->page->fingerprint);
+        }
+        else {
+            printd ("pageabort %d", job->id);
+        }
+        releasejob (ctx, job);
+        return;
+    case JobBuckets:
+        releasejob (ctx, job);
+        return;
+    case JobStrip:
+        /* the parts share the strip's render time */
+        elapsed /= job->strip->count;
+        splitstrip (job->strip);
+        for (int i = 0; i < job->strip->count; ++i) {
+            struct strippart *part = &job->strip->parts[i];
+
+            tile = part->tile;
+            printd ("tile %d %d %d %" PRIxPTR " %u %f",
+                    part->id, part->x, job->y, (uintptr_t) tile,
+                    finishtile (ctx, tile, 1), elapsed);
+        }
+        freestrip (ctx, job->strip);
+        releasejob (ctx, job);
+        return;
+    }
+    printd ("%s %d %d %d %" PRIxPTR " %u %f",
+            job->scale > 1 ? "tilepreview" : "tile",
+            job->id, job->x, job->y, (uintptr_t) tile,
+            finishtile (ctx, tile, job->scale == 1 && !job->banded),
+            elapsed);
+    releasejob (ctx, job);
+}
+
+/* previews share the id of the real tile and go away silently, the
+   real one speaks for both */
+static void dropjob (fz_context *ctx, struct renderjob *job)
+{
+    switch (job->kind) {
+    case JobPage:
+        printd ("pageabort %d", job->id);
+        releasejob (ctx, job);
+        return;
+    case JobBuckets:
+        /* the page goes on without them until the layout changes */
+        lockmutex (&state.pool.mutex, "dropjob");
+        if (!job->buckets->ready) {
+            job->buckets->ready = -1;
+        }
+        unlockmutex (&state.pool.mutex, "dropjob");
+        releasejob (ctx, job);
+        return;
+    case JobStrip:
+        for (int i = 0; i < job->strip->count; ++i) {
+            struct strippart *part = &job->strip->parts[i];
+
+            printd ("tiledrop %d", part->id);
+            fz_drop_pixmap (ctx, part->tile->pixmap);
+            free (part->tile);
+        }
+        freestrip (ctx, job->strip);
+        releasejob (ctx, job);
+        return;
     }
-    for (int i = 0; i < slicecount; ++i) {
-        int sh = fz_mini (h, state.sliceheight);
-        tile->slices[i].h = sh;
-        tile->slices[i].texindex = -1;
-        h -= sh;
+    if (job->scale == 1) {
+        printd ("tiledrop %d", job->id);
     }
-    tile->slicecount = slicecount;
-    tile->sliceheight = state.sliceheight;
-    return tile;
+    fz_drop_pixmap (ctx, job->tile->pixmap);
+    free (job->tile);
+    releasejob (ctx, job);
 }
 
-static struct tile *rendertile (struct page *page, int x, int y, int w, int h)
+/* the tile is handed back so that the UI frees it the usual way and
+   its pixmap gets recycled */
+static void abortjob (fz_context *ctx, struct renderjob *job)
 {
-    fz_irect bbox;
-    fz_matrix ctm;
-    fz_device *dev;
-    struct tile *tile;
-    struct pagedim *pdim;
+    if (job->kind == JobPage || job->kind == JobBuckets || job->scale > 1) {
+        dropjob (ctx, job);
+        return;
+    }
+    if (job->kind == JobStrip) {
+        for (int i = 0; i < job->strip->count; ++i) {
+            struct strippart *part = &job->strip->parts[i];
 
-    tile = alloctile (h);
-    pdim = &state.pagedims[page->pdimno];
+            printd ("tileabort %d %" PRIxPTR, part->id, (uintptr_t) part->tile);
+        }
+        freestrip (ctx, job->strip);
+        releasejob (ctx, job);
+        return;
+    }
+    printd ("tileabort %d %" PRIxPTR, job->id, (uintptr_t) job->tile);
+    releasejob (ctx, job);
+}
 
-    bbox = pdim->bounds;
-    bbox.x0 += x;
-    bbox.y0 += y;
-    bbox.x1 = bbox.x0 + w;
-    bbox.y1 = bbox.y0 + h;
+static void abortbands (struct renderjob *job)
+{
+    job->cancelled = 1;
+    for (int i = 0; i < job->bandcount; ++i) {
+        job->bands[i].cookie.abort = 1;
+    }
+}
+
+static void *renderloop (void *ctx)
+{
+    for (;;) {
+        int done, partial, id = 0, y0 = 0, y1 = 0;
+        struct tile *tile = NULL;
+        struct band *band;
+        struct renderjob *job;
+
+        lockmutex (&state.pool.mutex, "renderloop");
+        while (!state.pool.head) {
+            waitcond (&state.pool.cond, &state.pool.mutex, "renderloop");
+        }
+        job = state.pool.head;
+        if (job->cancelled && job->nextband == 0) {
+            state.pool.head = job->next;
+            state.pool.queued--;
+            state.pool.cancelled++;
+            unlockmutex (&state.pool.mutex, "renderloop");
+            dropjob (ctx, job);
+            continue;
+        }
+        if (job->nextband == 0) {
+            job->begin = now ();
+        }
+        band = &job->bands[job->nextband++];
+        if (job->nextband == job->bandcount) {
+            state.pool.head = job->next;
+            state.pool.queued--;
+            job->next = state.pool.running;
+            state.pool.running = job;
+        }
+        state.pool.busy++;
+        unlockmutex (&state.pool.mutex, "renderloop");
+
+        renderband (ctx, band);
+
+        lockmutex (&state.pool.mutex, "renderloop");
+        state.pool.busy--;
+        done = --job->bandsleft == 0;
+        partial = !done && job->banded && !job->cancelled
+            && !band->cookie.abort;
+        if (partial) {
+            /* the job may be gone as soon as the lock is released */
+            id = job->id;
+            tile = job->tile;
+            y0 = band->rect.y0 - job->bands[0].rect.y0;
+            y1 = band->rect.y1 - job->bands[0].rect.y0;
+        }
+        if (done) {
+            struct renderjob **pp = &state.pool.running;
 
-    if (state.pig) {
-        if (state.pig->w == w
-            && state.pig->h == h
-            && state.pig->colorspace == state.colorspace) {
-            tile->pixmap = state.pig;
-            tile->pixmap->x = bbox.x0;
-            tile->pixmap->y = bbox.y0;
+            while (*pp != job) {
+                pp = &(*pp)->next;
+            }
+            *pp = job->next;
+            if (job->cancelled) {
+                state.pool.aborted++;
+            }
+            else if (job->kind == JobPage) {
+                state.pool.pages++;
+            }
+            else if (job->kind != JobBuckets && job->scale == 1) {
+                int count = job->kind == JobStrip ? job->strip->count : 1;
+                double cost = (now () - job->begin) / count;
+
+                state.pool.rendered += count;
+                if (job->kind == JobTile) {
+                    state.pool.tiletime[job->bucketed] += cost;
+                    state.pool.tilecount[job->bucketed]++;
+                }
+                if (job->imagecache) {
+                    state.pool.imagetiles += count;
+                }
+                if (state.pool.budget > 0.0 && cost > state.pool.budget) {
+                    state.pool.budgethits++;
+                }
+                if (state.pool.pagecost) {
+                    state.pool.pagecost[job->pageno] = cost;
+                }
+            }
         }
-        else {
-            fz_drop_pixmap (state.ctx, state.pig);
+        unlockmutex (&state.pool.mutex, "renderloop");
+        if (partial) {
+            /* this can trail the final reply for the tile, in which
+               case the UI no longer knows the id and ignores it */
+            printd ("tileband %d %" PRIxPTR " %d %d",
+                    id, (uintptr_t) tile, y0, y1);
+        }
+        if (done) {
+            if (job->cancelled) {
+                abortjob (ctx, job);
+            }
+            else {
+                finishjob (ctx, job);
+            }
         }
-        state.pig = NULL;
-    }
-    if (!tile->pixmap) {
-        tile->pixmap = fz_new_pixmap_with_bbox (state.ctx,
-                                                state.colorspace,
-                                                bbox, NULL, 1);
     }
+    return NULL;
+}
 
-    tile->w = w;
-    tile->h = h;
-    fz_fill_pixmap_with_color (state.ctx, tile->pixmap,
-                               fz_device_rgb (state.ctx),
-                               state.papercolor,
-                               fz_default_color_params);
+/* the document must outlive the tiles that are still being rendered
+   from its display lists */
+static void drainpool (void)
+{
+    lockmutex (&state.pool.mutex, "drainpool");
+    while (state.pool.pending) {
+        waitcond (&state.pool.idle, &state.pool.mutex, "drainpool");
+    }
+    unlockmutex (&state.pool.mutex, "drainpool");
+}
 
-    dev = fz_new_draw_device (state.ctx, fz_identity, tile->pixmap);
-    ctm = pagectm (page);
-    fz_run_display_list (state.ctx, page->dlist, dev, ctm,
-                         fz_rect_from_irect (bbox), NULL);
-    fz_close_device (state.ctx, dev);
-    fz_drop_device (state.ctx, dev);
+static void startpool (int count)
+{
+    if (count <= 0) {
+        long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+        count = ncpus > 0 ? (int) ncpus : 1;
+    }
+    state.pool.threads = calloc (count, sizeof (*state.pool.threads));
+    if (!state.pool.threads) {
+        err (1, errno, "calloc render threads %d", count);
+    }
+    for (int i = 0; i < count; ++i) {
+        int ret;
+        fz_context *ctx = fz_clone_context (state.ctx);
 
-    return tile;
+        if (!ctx) {
+            errx (1, "cannot clone context for render thread %d", i);
+        }
+        ret = pthread_create (&state.pool.threads[i], NULL, renderloop, ctx);
+        if (ret) {
+            errx (1, "pthread_create: %d(%s)", ret, strerror (ret));
+        }
+        state.pool.count = i + 1;
+    }
 }
 
 static void initpdims1 (void)
@@ -588,6 +3071,7 @@ static void initpdims1 (void)
     fz_var (pageno);
     fz_var (cxcount);
 
+    memset (&state.cookie, 0, sizeof (state.cookie));
     cxcount = state.pagecount;
     if ((pdf = pdf_specifics (ctx, state.doc))) {
         pdf_obj *obj = pdf_dict_getp (ctx, pdf_trailer (ctx, pdf),
@@ -621,7 +3105,7 @@ static void initpdims1 (void)
 
             rotate = pdf_to_int (ctx, pdf_dict_gets (ctx, pageobj, "Rotate"));
 
-            if (state.trimmargins) {
+            if (state.trimmargins && !state.cookie.abort) {
                 pdf_obj *obj;
                 pdf_page *page;
 
@@ -637,27 +3121,33 @@ static void initpdims1 (void)
                         dev = fz_new_bbox_device (ctx, &rect);
                         pdf_page_transform (ctx, page, &mediabox, &page_ctm);
                         ctm = fz_invert_matrix (page_ctm);
-                        pdf_run_page (ctx, page, dev, fz_identity, NULL);
+                        pdf_run_page (ctx, page, dev, fz_identity,
+                                      &state.cookie);
                         fz_close_device (ctx, dev);
                         fz_drop_device (ctx, dev);
-
-                        rect.x0 += state.trimfuzz.x0;
-                        rect.x1 += state.trimfuzz.x1;
-                        rect.y0 += state.trimfuzz.y0;
-                        rect.y1 += state.trimfuzz.y1;
-                        rect = fz_transform_rect (rect, ctm);
-                        rect = fz_intersect_rect (rect, mediabox);
-
-                        if (!fz_is_empty_rect (rect)) {
-                            mediabox = rect;
+                        if (state.cookie.abort) {
+                            printd ("vmsg trimming interrupted at page %d",
+                                    pageno + 1);
                         }
+                        else {
+                            rect.x0 += state.trimfuzz.x0;
+                            rect.x1 += state.trimfuzz.x1;
+                            rect.y0 += state.trimfuzz.y0;
+                            rect.y1 += state.trimfuzz.y1;
+                            rect = fz_transform_rect (rect, ctm);
+                            rect = fz_intersect_rect (rect, mediabox);
+
+                            if (!fz_is_empty_rect (rect)) {
+                                mediabox = rect;
+                            }
 
-                        obj = pdf_new_array (ctx, pdf, 4);
-                        pdf_array_push_real (ctx, obj, mediabox.x0);
-                        pdf_array_push_real (ctx, obj, mediabox.y0);
-                        pdf_array_push_real (ctx, obj, mediabox.x1);
-                        pdf_array_push_real (ctx, obj, mediabox.y1);
-                        pdf_dict_puts (ctx, pageobj, "llpp.TrimBox", obj);
+                            obj = pdf_new_array (ctx, pdf, 4);
+                            pdf_array_push_real (ctx, obj, mediabox.x0);
+                            pdf_array_push_real (ctx, obj, mediabox.y0);
+                            pdf_array_push_real (ctx, obj, mediabox.x1);
+                            pdf_array_push_real (ctx, obj, mediabox.y1);
+                            pdf_dict_puts (ctx, pageobj, "llpp.TrimBox", obj);
+                        }
                     }
                     else {
                         mediabox.x0 = pdf_array_get_real (ctx, obj, 0);
@@ -844,6 +3334,12 @@ static void initpdims (void)
             fclose (f);
         }
     }
+
+    /* trim matrices only depend on the page boxes, not on the zoom
+       or rotation, so they survive layouts until the boxes change */
+    for (int i = 0; i < state.pagedimcount; ++i) {
+        state.pagedims[i].tctmready = 0;
+    }
 }
 
 static void layout (void)
@@ -927,7 +3423,6 @@ static void layout (void)
 
         ctm = fz_concat (fz_translate (0, -p->mediabox.y1),
                          fz_scale (zoom, -zoom));
-        p->tctmready = 0;
     }
 
     do {
@@ -1210,6 +3705,8 @@ static void search (regex_t *re, int pageno, int y, int forward)
     printd ("clearrects");
 }
 
+/* pages are opaque, so the alpha channel of the tiles only costs
+   memory and upload bandwidth; the opaque variants go without */
 static void set_tex_params (int colorspace)
 {
     switch (colorspace) {
@@ -1218,12 +3715,28 @@ static void set_tex_params (int colorspace)
         state.tex.form = GL_RGBA;
         state.tex.ty = GL_UNSIGNED_BYTE;
         state.colorspace = fz_device_rgb (state.ctx);
+        state.alpha = 1;
         break;
     case 1:
         state.tex.iform = GL_LUMINANCE_ALPHA;
         state.tex.form = GL_LUMINANCE_ALPHA;
         state.tex.ty = GL_UNSIGNED_BYTE;
         state.colorspace = fz_device_gray (state.ctx);
+        state.alpha = 1;
+        break;
+    case 2:
+        state.tex.iform = GL_RGB8;
+        state.tex.form = GL_RGB;
+        state.tex.ty = GL_UNSIGNED_BYTE;
+        state.colorspace = fz_device_rgb (state.ctx);
+        state.alpha = 0;
+        break;
+    case 3:
+        state.tex.iform = GL_LUMINANCE8;
+        state.tex.form = GL_LUMINANCE;
+        state.tex.ty = GL_UNSIGNED_BYTE;
+        state.colorspace = fz_device_gray (state.ctx);
+        state.alpha = 0;
         break;
     default:
         errx (1, "invalid colorspce %d", colorspace);
@@ -1254,11 +3767,11 @@ static void realloctexts (int texcount)
                        state.tex.ids + state.tex.count);
         for (int i = state.tex.count; i < texcount; ++i) {
             state.tex.owners[i].w = -1;
+            state.tex.owners[i].used = 0;
             state.tex.owners[i].slice = NULL;
         }
     }
     state.tex.count = texcount;
-    state.tex.index = 0;
 }
 
 static char *mbtoutf8 (char *s)
@@ -1325,11 +3838,206 @@ ML (mbtoutf8 (value s_v))
     if (r == s) {
         ret_v = s_v;
     }
-    else {
-        ret_v = caml_copy_string (r);
-        free (r);
+    else {
+        ret_v = caml_copy_string (r);
+        free (r);
+    }
+    CAMLreturn (ret_v);
+}
+
+static void ensurelinks (struct page *page)
+{
+    if (!page->links) {
+        page->links = fz_load_links (state.ctx, page->fzpage);
+    }
+}
+
+static int compareslinks (const void *l, const void *r)
+{
+    struct slink const *ls = l;
+    struct slink const *rs = r;
+    if (ls->bbox.y0 == rs->bbox.y0) {
+        return ls->bbox.x0 - rs->bbox.x0;
+    }
+    return ls->bbox.y0 - rs->bbox.y0;
+}
+
+static void droptext (struct page *page)
+{
+    if (page->text) {
+        fz_drop_stext_page (state.uictx, page->text);
+        page->fmark = NULL;
+        page->lmark = NULL;
+        page->text = NULL;
+    }
+}
+
+static void dropannots (struct page *page)
+{
+    if (page->annots) {
+        free (page->annots);
+        page->annots = NULL;
+        page->annotcount = 0;
+    }
+}
+
+static void ensureannots (struct page *page)
+{
+    int i, count = 0;
+    pdf_annot *annot;
+    pdf_document *pdf;
+    pdf_page *pdfpage;
+
+    pdf = pdf_specifics (state.ctx, state.doc);
+    if (!pdf) {
+        return;
+    }
+
+    pdfpage = pdf_page_from_fz_page (state.ctx, page->fzpage);
+    if (state.gen != page->agen) {
+        dropannots (page);
+        page->agen = state.gen;
+    }
+    if (page->annots) {
+        return;
+    }
+
+    for (annot = pdf_first_annot (state.ctx, pdfpage);
+         annot;
+         annot = pdf_next_annot (state.ctx, annot)) {
+        count++;
+    }
+
+    if (count > 0) {
+        page->annotcount = count;
+        page->annots = calloc (count, sizeof (*page->annots));
+        if (!page->annots) {
+            err (1, errno, "calloc annots %d", count);
+        }
+
+        for (annot = pdf_first_annot (state.ctx, pdfpage), i = 0;
+             annot;
+             annot = pdf_next_annot (state.ctx, annot), i++) {
+            fz_rect rect;
+
+            rect = pdf_bound_annot (state.ctx, annot);
+            page->annots[i].type = pdf_annot_type (state.ctx, annot);
+            page->annots[i].annot = annot;
+            page->annots[i].bbox = fz_round_rect (rect);
+        }
+    }
+}
+
+static void dropslinks (struct page *page)
+{
+    if (page->slinks) {
+        free (page->slinks);
+        page->slinks = NULL;
+        page->slinkcount = 0;
+    }
+    if (page->links) {
+        fz_drop_link (state.ctx, page->links);
+        page->links = NULL;
+    }
+}
+
+static void ensureslinks (struct page *page)
+{
+    fz_matrix ctm;
+    int i, count;
+    size_t slinksize = sizeof (*page->slinks);
+    fz_link *link;
+
+    ensureannots (page);
+    if (state.gen != page->sgen) {
+        dropslinks (page);
+        page->sgen = state.gen;
+    }
+    if (page->slinks) {
+        return;
+    }
+
+    ensurelinks (page);
+    ctm = pagectm (page);
+
+    count = page->annotcount;
+    for (link = page->links; link; link = link->next) {
+        count++;
+    }
+    if (count > 0) {
+        int j;
+
+        page->slinkcount = count;
+        page->slinks = calloc (count, slinksize);
+        if (!page->slinks) {
+            err (1, errno, "calloc slinks %d", count);
+        }
+
+        for (i = 0, link = page->links; link; ++i, link = link->next) {
+            fz_rect rect;
+
+            rect = link->rect;
+            rect = fz_transform_rect (rect, ctm);
+            page->slinks[i].tag = SLINK;
+            page->slinks[i].u.link = link;
+            page->slinks[i].bbox = fz_round_rect (rect);
+        }
+        for (j = 0; j < page->annotcount; ++j, ++i) {
+            fz_rect rect;
+            rect = pdf_bound_annot (state.ctx, page->annots[j].annot);
+            rect = fz_transform_rect (rect, ctm);
+            page->slinks[i].bbox = fz_round_rect (rect);
+
+            page->slinks[i].tag = SANNOT;
+            page->slinks[i].type = page->annots[j].type;
+            page->slinks[i].u.annot = page->annots[j].annot;
+        }
+        qsort (page->slinks, count, slinksize, compareslinks);
+    }
+}
+
+/* must be called with the document locked */
+static void refreshpage (struct page *page)
+{
+    struct pagedim *pdim = &state.pagedims[page->pdimno];
+
+    lockmutex (&page->mutex, "refreshpage");
+    ensureslinks (page);
+    page->ctm = pagectm (page);
+    page->bounds = pdim->bounds;
+    page->mediabox = pdim->mediabox;
+    unlockmutex (&page->mutex, "refreshpage");
+}
+
+/* Links, annotations and the text layer of a page are only looked at
+   under the page's own mutex: the UI brings them up to date when the
+   document happens to be free and otherwise makes do with the ones
+   made for the view the tile requests last refreshed them for, so
+   that it never waits for a page load or a search.  The document,
+   when needed, is always locked before the page */
+static void lockpage (struct page *page, const char *cap)
+{
+    if (!trylock (cap)) {
+        refreshpage (page);
+        unlock (cap);
+    }
+    lockmutex (&page->mutex, cap);
+}
+
+static void unlockpage (struct page *page, const char *cap)
+{
+    unlockmutex (&page->mutex, cap);
+}
+
+/* tiles are queued without the document (a worker may be busy
+   interpreting a page under it), the links of the page they belong
+   to are brought up to date only if it is free */
+static void refreshtiled (struct page *page, const char *cap)
+{
+    if (!trylock (cap)) {
+        refreshpage (page);
+        unlock (cap);
     }
-    CAMLreturn (ret_v);
 }
 
 static void *mainloop (void UNUSED_ATTR *unused)
@@ -1381,6 +4089,9 @@ static void *mainloop (void UNUSED_ATTR *unused)
                 fz_set_user_css (state.ctx, password + strlen (password) + 1);
             }
 
+            drainpool ();
+            free (state.pool.pagecost);
+            state.pool.pagecost = NULL;
             lock ("open");
             fz_set_use_document_css (state.ctx, usedoccss);
             fz_try (state.ctx) {
@@ -1398,6 +4109,11 @@ static void *mainloop (void UNUSED_ATTR *unused)
             if (ok) {
                 docinfo ();
                 initpdims ();
+                state.pool.pagecost = calloc (state.pagecount + 1,
+                                              sizeof (*state.pool.pagecost));
+                if (!state.pool.pagecost) {
+                    err (1, errno, "calloc pagecost %d", state.pagecount);
+                }
             }
             unlock ("open");
             state.needoutline = ok;
@@ -1438,9 +4154,7 @@ static void *mainloop (void UNUSED_ATTR *unused)
             if (ret != 1) {
                 errx (1, "malformed freetile `%.*s' ret=%d", len, p, ret);
             }
-            lock ("freetile");
             freetile (ptr);
-            unlock ("freetile");
             break;
         }
         case Csearch: {
@@ -1535,45 +4249,94 @@ static void *mainloop (void UNUSED_ATTR *unused)
             break;
         }
         case Cpage: {
-            double a, b;
-            struct page *page;
-            int pageno, pindex;
+            int id, prio, pageno, pindex;
 
-            ret = sscanf (p, "%d %d", &pageno, &pindex);
-            if (ret != 2) {
+            ret = sscanf (p, "%d %d %d %d", &id, &prio, &pageno, &pindex);
+            if (ret != 4) {
                 errx (1, "bad page line `%.*s' ret=%d", len, p, ret);
             }
 
-            lock ("page");
-            a = now ();
-            page = loadpage (pageno, pindex);
-            b = now ();
-            unlock ("page");
-
-            printd ("page %" PRIxPTR " %f", (uintptr_t) page, b - a);
+            queuepage (id, prio, pageno, pindex);
             break;
         }
         case Ctile: {
-            int x, y, w, h;
+            int id, prio, x, y, w, h, progressive, quality;
             struct page *page;
-            struct tile *tile;
-            double a, b;
 
-            ret = sscanf (p, "%" SCNxPTR " %d %d %d %d",
-                          (uintptr_t *) &page, &x, &y, &w, &h);
-            if (ret != 5) {
+            ret = sscanf (p, "%d %d %" SCNxPTR " %d %d %d %d %d %d",
+                          &id, &prio, (uintptr_t *) &page, &x, &y, &w, &h,
+                          &progressive, &quality);
+            if (ret != 9) {
                 errx (1, "bad tile line `%.*s' ret=%d", len, p, ret);
             }
 
-            lock ("tile");
-            a = now ();
-            tile = rendertile (page, x, y, w, h);
-            b = now ();
-            unlock ("tile");
+            queuetile (id, prio, page, x, y, w, h, progressive, quality);
+            refreshtiled (page, "tile");
+            break;
+        }
+        case Ctiles: {
+            int prio, quality, y, h, count, off, n;
+            struct page *page;
+            struct strip *strip;
+            size_t stripsize;
+
+            ret = sscanf (p, "%d %d %" SCNxPTR " %d %d %d%n",
+                          &prio, &quality, (uintptr_t *) &page,
+                          &y, &h, &count, &off);
+            if (ret != 6 || count <= 0) {
+                errx (1, "bad tiles line `%.*s' ret=%d", len, p, ret);
+            }
+
+            stripsize = sizeof (*strip) + count * sizeof (struct strippart);
+            strip = calloc (stripsize, 1);
+            if (!strip) {
+                err (1, errno, "cannot allocate strip (%zu bytes)", stripsize);
+            }
+            strip->count = count;
+            for (int i = 0; i < count; ++i) {
+                struct strippart *part = &strip->parts[i];
+                int w;
+
+                ret = sscanf (p + off, " %d %d %d%n",
+                              &part->id, &part->x, &w, &n);
+                if (ret != 3) {
+                    errx (1, "bad tiles line `%.*s' ret=%d", len, p, ret);
+                }
+                off += n;
+                part->tile = alloctile (h);
+                part->tile->w = w;
+                part->tile->h = h;
+            }
+
+            for (int i = 0; i < strip->count; ) {
+                struct strippart *part = &strip->parts[i];
+
+                if (blanktile (page, part->x, y, part->tile->w, h)) {
+                    papertile (part->id, part->x, y, part->tile);
+                    memmove (part, part + 1,
+                             (--strip->count - i) * sizeof (*part));
+                }
+                else {
+                    ++i;
+                }
+            }
+            if (!strip->count) {
+                free (strip);
+            }
+            else if (strip->count == 1 || overbudget (page->pageno)) {
+                for (int i = 0; i < strip->count; ++i) {
+                    struct strippart *part = &strip->parts[i];
 
-            printd ("tile %d %d %" PRIxPTR " %u %f",
-                    x, y, (uintptr_t) tile,
-                    tile->w * tile->h * tile->pixmap->n, b - a);
+                    queuetile (part->id, prio, page, part->x, y,
+                               part->tile->w, h, 0, quality);
+                    free (part->tile);
+                }
+                free (strip);
+            }
+            else {
+                queuestrip (prio, page, y, h, strip, quality);
+            }
+            refreshtiled (page, "tiles");
             break;
         }
         case Ctrimset: {
@@ -1615,6 +4378,7 @@ static void *mainloop (void UNUSED_ATTR *unused)
             state.pagedimcount = 0;
             free (state.pagedims);
             state.pagedims = NULL;
+            state.pdimgen++;
             initpdims ();
             layout ();
             process_outline ();
@@ -1642,6 +4406,25 @@ static void *mainloop (void UNUSED_ATTR *unused)
         case Cinterrupt:
             printd ("vmsg interrupted");
             break;
+        case Ccost: {
+            int pageno;
+            double cost;
+
+            ret = sscanf (p, "%d %lf", &pageno, &cost);
+            if (ret != 2) {
+                errx (1, "malformed cost `%.*s' ret=%d", len, p, ret);
+            }
+
+            /* what the UI remembers from an earlier visit, until this
+               one measures it */
+            lockmutex (&state.pool.mutex, "cost");
+            if (state.pool.pagecost && pageno >= 0 && pageno < state.pagecount
+                && state.pool.pagecost[pageno] == 0.0f) {
+                state.pool.pagecost[pageno] = (float) cost;
+            }
+            unlockmutex (&state.pool.mutex, "cost");
+            break;
+        }
         default:
             errx (1, "unknown llpp ffi  command - %d [%.*s]", c, len, p);
         }
@@ -1676,6 +4459,200 @@ ML (uritolocation (value uri_v))
     CAMLreturn (ret_v);
 }
 
+static int newprio (value prios_v, int id, int prio)
+{
+    mlsize_t count = Wosize_val (prios_v);
+
+    for (mlsize_t i = 0; i < count; ++i) {
+        value prio_v = Field (prios_v, i);
+
+        if (Int_val (Field (prio_v, 0)) == id) {
+            return Int_val (Field (prio_v, 1));
+        }
+    }
+    return prio;
+}
+
+/* a strip is as urgent as its most urgent tile and only goes away
+   when all of its tiles do */
+static int jobprio (value prios_v, struct renderjob *job)
+{
+    int prio = -1;
+
+    if (job->kind != JobStrip) {
+        return newprio (prios_v, job->id, job->prio);
+    }
+    for (int i = 0; i < job->strip->count; ++i) {
+        int p = newprio (prios_v, job->strip->parts[i].id, job->prio);
+
+        if (p >= 0 && (prio < 0 || p < prio)) {
+            prio = p;
+        }
+    }
+    return prio;
+}
+
+ML0 (reprioritize (value prios_v))
+{
+    CAMLparam1 (prios_v);
+    struct renderjob *job, *next;
+
+    lockmutex (&state.pool.mutex, __func__);
+    job = state.pool.head;
+    state.pool.head = NULL;
+    for (; job; job = next) {
+        int prio = jobprio (prios_v, job);
+
+        next = job->next;
+        /* cancelled tiles go to the front so that the next free
+           worker hands them back (or skips their remaining bands) */
+        if (prio < 0) {
+            if (job->nextband == 0) {
+                job->cancelled = 1;
+            }
+            else {
+                abortbands (job);
+            }
+            prio = INT_MIN;
+        }
+        job->prio = prio;
+        enqueuejob (job);
+    }
+    for (job = state.pool.running; job; job = job->next) {
+        if (jobprio (prios_v, job) < 0) {
+            abortbands (job);
+        }
+    }
+    pthread_cond_broadcast (&state.pool.cond);
+    unlockmutex (&state.pool.mutex, __func__);
+    CAMLreturn0;
+}
+
+ML0 (interrupt (value unit_v))
+{
+    CAMLparam1 (unit_v);
+    state.cookie.abort = 1;
+
+    lockmutex (&state.pool.mutex, __func__);
+    for (struct renderjob *job = state.pool.running; job; job = job->next) {
+        if (job->kind == JobPage) {
+            job->bands[0].cookie.abort = 1;
+        }
+    }
+    unlockmutex (&state.pool.mutex, __func__);
+    CAMLreturn0;
+}
+
+ML (renderstats (void))
+{
+    CAMLparam0 ();
+    CAMLlocal3 (ret_v, tup_v, str_v);
+    char buf[64];
+    struct { const char *name; long value; } stats[] = {
+        { "render threads", 0 },
+        { "queued tiles", 0 },
+        { "busy threads", 0 },
+        { "rendered tiles", 0 },
+        { "cancelled tiles", 0 },
+        { "aborted tiles", 0 },
+        { "budget hits", 0 },
+        { "previews", 0 },
+        { "loaded pages", 0 },
+        { "batched strips", 0 },
+        { "image-only tiles", 0 },
+        { "pixmap pool hits", 0 },
+        { "pixmap pool misses", 0 },
+        { "blank tiles", 0 },
+        { "gray tiles", 0 },
+        { "packed tiles", 0 },
+        { "packed size %", 0 },
+        { "avg unpack us", 0 },
+        { "baked bands", 0 },
+        { "avg bake us", 0 },
+        { "avg tile ms (whole list)", 0 },
+        { "avg tile ms (bucketed)", 0 },
+        { "texture uploads", 0 },
+        { "staged tiles", 0 },
+        { "staged uploads", 0 },
+        { "upload KiB/frame", 0 },
+        { "upload us/frame", 0 },
+        { "worst upload us/frame", 0 },
+        { "texture slots", 0 },
+        { "slots drawn last frame", 0 },
+        { "texture hits", 0 },
+        { "texture evictions", 0 },
+        { "evicted while on screen", 0 },
+    };
+    int count = sizeof (stats) / sizeof (*stats);
+
+    lockmutex (&state.pool.mutex, __func__);
+    stats[0].value = state.pool.count;
+    stats[1].value = state.pool.queued;
+    stats[2].value = state.pool.busy;
+    stats[3].value = state.pool.rendered;
+    stats[4].value = state.pool.cancelled;
+    stats[5].value = state.pool.aborted;
+    stats[6].value = state.pool.budgethits;
+    stats[7].value = state.pool.previews;
+    stats[8].value = state.pool.pages;
+    stats[9].value = state.pool.strips;
+    stats[10].value = state.pool.imagetiles;
+    stats[11].value = state.pool.pighits;
+    stats[12].value = state.pool.pigmisses;
+    stats[13].value = state.pool.blanktiles;
+    stats[14].value = state.pool.graytiles;
+    stats[15].value = state.pool.packs;
+    if (state.pool.packedin) {
+        stats[16].value = 100 * state.pool.packedout / state.pool.packedin;
+    }
+    if (state.pool.unpacks) {
+        stats[17].value = (long) (1e6 * state.pool.unpacktime
+                                  / state.pool.unpacks);
+    }
+    stats[18].value = state.pool.bakes;
+    if (state.pool.bakes) {
+        stats[19].value = (long) (1e6 * state.pool.baketime
+                                  / state.pool.bakes);
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (state.pool.tilecount[i]) {
+            stats[20 + i].value = (long) (1e3 * state.pool.tiletime[i]
+                                          / state.pool.tilecount[i]);
+        }
+    }
+    unlockmutex (&state.pool.mutex, __func__);
+    stats[22].value = state.pbo.uploads;
+    stats[23].value = state.pbo.stagings;
+    stats[24].value = state.pbo.staged;
+    if (state.pbo.frames) {
+        stats[25].value = state.pbo.bytes / 1024 / state.pbo.frames;
+        stats[26].value = (long) (1e6 * state.pbo.time / state.pbo.frames);
+    }
+    stats[27].value = (long) (1e6 * state.pbo.worst);
+    stats[28].value = state.tex.count;
+    for (int i = 0; i < state.tex.count; ++i) {
+        if (state.tex.owners[i].slice
+            && state.tex.owners[i].used + 1 == state.tex.frame) {
+            stats[29].value++;
+        }
+    }
+    stats[30].value = state.tex.hits;
+    stats[31].value = state.tex.evictions;
+    stats[32].value = state.tex.onscreen;
+
+    ret_v = caml_alloc_tuple (count);
+    for (int i = 0; i < count; ++i) {
+        tup_v = caml_alloc_tuple (2);
+        Store_field (ret_v, i, tup_v);
+        str_v = caml_copy_string (stats[i].name);
+        Store_field (tup_v, 0, str_v);
+        snprintf (buf, sizeof (buf), "%ld", stats[i].value);
+        str_v = caml_copy_string (buf);
+        Store_field (tup_v, 1, str_v);
+    }
+    CAMLreturn (ret_v);
+}
+
 ML (realloctexts (value texcount_v))
 {
     CAMLparam1 (texcount_v);
@@ -1721,8 +4698,8 @@ static void showsel (struct page *page, int ox, int oy)
     glBlendFunc (GL_SRC_ALPHA, GL_SRC_ALPHA);
     glColor4ubv (selcolor);
 
-    ox += state.pagedims[page->pdimno].bounds.x0;
-    oy += state.pagedims[page->pdimno].bounds.y0;
+    ox += page->bounds.x0;
+    oy += page->bounds.y0;
 
     for (block = page->text->first_block; block; block = block->next) {
         fz_stext_line *line;
@@ -1797,13 +4774,6 @@ static void stipplerect (fz_matrix m, fz_point p[4],
     glDrawArrays (GL_LINES, 0, 8);
 }
 
-static void ensurelinks (struct page *page)
-{
-    if (!page->links) {
-        page->links = fz_load_links (state.ctx, page->fzpage);
-    }
-}
-
 static void highlightlinks (struct page *page, int xoff, int yoff)
 {
     fz_point p[4];
@@ -1812,8 +4782,6 @@ static void highlightlinks (struct page *page, int xoff, int yoff)
     GLfloat *texcoords = state.texcoords;
     GLfloat *vertices = state.vertices;
 
-    ensurelinks (page);
-
     glEnable (GL_TEXTURE_1D);
     glEnable (GL_BLEND);
     glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -1821,7 +4789,7 @@ static void highlightlinks (struct page *page, int xoff, int yoff)
 
     xoff -= state.pagedims[page->pdimno].bounds.x0;
     yoff -= state.pagedims[page->pdimno].bounds.y0;
-    ctm = fz_concat (pagectm (page), fz_translate (xoff, yoff));
+    ctm = fz_concat (page->ctm, fz_translate (xoff, yoff));
 
     glTexCoordPointer (1, GL_FLOAT, 0, texcoords);
     glVertexPointer (2, GL_FLOAT, 0, vertices);
@@ -1874,148 +4842,6 @@ static void highlightlinks (struct page *page, int xoff, int yoff)
     glDisable (GL_TEXTURE_1D);
 }
 
-static int compareslinks (const void *l, const void *r)
-{
-    struct slink const *ls = l;
-    struct slink const *rs = r;
-    if (ls->bbox.y0 == rs->bbox.y0) {
-        return ls->bbox.x0 - rs->bbox.x0;
-    }
-    return ls->bbox.y0 - rs->bbox.y0;
-}
-
-static void droptext (struct page *page)
-{
-    if (page->text) {
-        fz_drop_stext_page (state.ctx, page->text);
-        page->fmark = NULL;
-        page->lmark = NULL;
-        page->text = NULL;
-    }
-}
-
-static void dropannots (struct page *page)
-{
-    if (page->annots) {
-        free (page->annots);
-        page->annots = NULL;
-        page->annotcount = 0;
-    }
-}
-
-static void ensureannots (struct page *page)
-{
-    int i, count = 0;
-    pdf_annot *annot;
-    pdf_document *pdf;
-    pdf_page *pdfpage;
-
-    pdf = pdf_specifics (state.ctx, state.doc);
-    if (!pdf) {
-        return;
-    }
-
-    pdfpage = pdf_page_from_fz_page (state.ctx, page->fzpage);
-    if (state.gen != page->agen) {
-        dropannots (page);
-        page->agen = state.gen;
-    }
-    if (page->annots) {
-        return;
-    }
-
-    for (annot = pdf_first_annot (state.ctx, pdfpage);
-         annot;
-         annot = pdf_next_annot (state.ctx, annot)) {
-        count++;
-    }
-
-    if (count > 0) {
-        page->annotcount = count;
-        page->annots = calloc (count, sizeof (*page->annots));
-        if (!page->annots) {
-            err (1, errno, "calloc annots %d", count);
-        }
-
-        for (annot = pdf_first_annot (state.ctx, pdfpage), i = 0;
-             annot;
-             annot = pdf_next_annot (state.ctx, annot), i++) {
-            fz_rect rect;
-
-            rect = pdf_bound_annot (state.ctx, annot);
-            page->annots[i].annot = annot;
-            page->annots[i].bbox = fz_round_rect (rect);
-        }
-    }
-}
-
-static void dropslinks (struct page *page)
-{
-    if (page->slinks) {
-        free (page->slinks);
-        page->slinks = NULL;
-        page->slinkcount = 0;
-    }
-    if (page->links) {
-        fz_drop_link (state.ctx, page->links);
-        page->links = NULL;
-    }
-}
-
-static void ensureslinks (struct page *page)
-{
-    fz_matrix ctm;
-    int i, count;
-    size_t slinksize = sizeof (*page->slinks);
-    fz_link *link;
-
-    ensureannots (page);
-    if (state.gen != page->sgen) {
-        dropslinks (page);
-        page->sgen = state.gen;
-    }
-    if (page->slinks) {
-        return;
-    }
-
-    ensurelinks (page);
-    ctm = pagectm (page);
-
-    count = page->annotcount;
-    for (link = page->links; link; link = link->next) {
-        count++;
-    }
-    if (count > 0) {
-        int j;
-
-        page->slinkcount = count;
-        page->slinks = calloc (count, slinksize);
-        if (!page->slinks) {
-            err (1, errno, "calloc slinks %d", count);
-        }
-
-        for (i = 0, link = page->links; link; ++i, link = link->next) {
-            fz_rect rect;
-
-            rect = link->rect;
-            rect = fz_transform_rect (rect, ctm);
-            page->slinks[i].tag = SLINK;
-            page->slinks[i].u.link = link;
-            page->slinks[i].bbox = fz_round_rect (rect);
-        }
-        for (j = 0; j < page->annotcount; ++j, ++i) {
-            fz_rect rect;
-            rect = pdf_bound_annot (state.ctx, page->annots[j].annot);
-            rect = fz_transform_rect (rect, ctm);
-            page->slinks[i].bbox = fz_round_rect (rect);
-
-            page->slinks[i].tag = SANNOT;
-            page->slinks[i].u.annot = page->annots[j].annot;
-        }
-        qsort (page->slinks, count, slinksize, compareslinks);
-    }
-}
-
 static void highlightslinks (struct page *page, int xoff, int yoff,
                              int noff, const char *targ, unsigned int tlen,
                              const char *chars, unsigned int clen, int hfsize)
@@ -2024,7 +4850,6 @@ static void highlightslinks (struct page *page, int xoff, int yoff,
     struct slink *slink;
     float x0, y0, x1, y1, w;
 
-    ensureslinks (page);
     glColor3ub (0xc3, 0xb0, 0x91);
     for (int i = 0; i < page->slinkcount; ++i) {
         fmt_linkn (buf, chars, clen, i + noff);
@@ -2054,15 +4879,70 @@ static void highlightslinks (struct page *page, int xoff, int yoff,
             draw_string (state.face, hfsize, x0, y0, buf);
         }
     }
-    glDisable (GL_TEXTURE_2D);
-    glDisable (GL_BLEND);
+    glDisable (GL_TEXTURE_2D);
+    glDisable (GL_BLEND);
+}
+
+/* empty slots go first, then the least recently drawn ones; a slot
+   drawn in the current frame only when nothing else is left.  Among
+   equally old slots one already shaped for the slice wins, it is
+   refilled in place */
+static int texslot (int w, int h, GLenum iform)
+{
+    int best = -1, bestfits = 0;
+    unsigned long bestage = 0;
+
+    for (int i = 0; i < state.tex.count; ++i) {
+        unsigned long age = state.tex.owners[i].slice
+            ? state.tex.owners[i].used + 1
+            : 0;
+        int fits = state.tex.owners[i].w == w
+            && state.tex.owners[i].iform == iform
+            && state.tex.owners[i].h >= h;
+
+        if (best < 0 || age < bestage || (age == bestage && fits > bestfits)) {
+            best = i;
+            bestage = age;
+            bestfits = fits;
+        }
+    }
+    if (state.tex.owners[best].slice) {
+        state.tex.evictions++;
+        if (state.tex.owners[best].used == state.tex.frame) {
+            state.tex.onscreen++;
+        }
+    }
+    return best;
+}
+
+/* the pixel buffer holding the tile if it was staged and not yet
+   overwritten, 0 otherwise */
+static GLuint stagedbuffer (struct tile *tile)
+{
+    for (int i = 0; i < state.pbo.count; ++i) {
+        if (state.pbo.slots[i].tile == tile
+            && state.pbo.slots[i].serial == tile->serial) {
+            return state.pbo.slots[i].id;
+        }
+    }
+    return 0;
 }
 
 static void uploadslice (struct tile *tile, struct slice *slice)
 {
     int offset;
+    size_t size;
+    double start;
+    GLuint pbo;
     struct slice *slice1;
-    unsigned char *texdata;
+    const void *texdata;
+    GLenum iform = state.tex.iform, form = state.tex.form;
+
+    /* tiles found to be gray are kept as plain luminance */
+    if (tile->pixmap->n == 1) {
+        iform = GL_LUMINANCE8;
+        form = GL_LUMINANCE;
+    }
 
     offset = 0;
     for (slice1 = tile->slices; slice != slice1; slice1++) {
@@ -2070,13 +4950,16 @@ static void uploadslice (struct tile *tile, struct slice *slice)
     }
     if (slice->texindex != -1 && slice->texindex < state.tex.count
         && state.tex.owners[slice->texindex].slice == slice) {
+        state.tex.hits++;
+        state.tex.owners[slice->texindex].used = state.tex.frame;
         glBindTexture (TEXT_TYPE, state.tex.ids[slice->texindex]);
     }
     else {
         int subimage = 0;
-        int texindex = state.tex.index++ % state.tex.count;
+        int texindex = texslot (tile->w, slice->h, iform);
 
-        if (state.tex.owners[texindex].w == tile->w) {
+        if (state.tex.owners[texindex].w == tile->w
+            && state.tex.owners[texindex].iform == iform) {
             if (state.tex.owners[texindex].h >= slice->h) {
                 subimage = 1;
             }
@@ -2089,26 +4972,106 @@ static void uploadslice (struct tile *tile, struct slice *slice)
         }
 
         state.tex.owners[texindex].w = tile->w;
+        state.tex.owners[texindex].iform = iform;
+        state.tex.owners[texindex].used = state.tex.frame;
         state.tex.owners[texindex].slice = slice;
         slice->texindex = texindex;
 
         glBindTexture (TEXT_TYPE, state.tex.ids[texindex]);
 #if TEXT_TYPE == GL_TEXTURE_2D
         glTexParameteri (TEXT_TYPE, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri (TEXT_TYPE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri (TEXT_TYPE, GL_TEXTURE_MAG_FILTER,
+                         tile->scale > 1 ? GL_LINEAR : GL_NEAREST);
         glTexParameteri (TEXT_TYPE, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri (TEXT_TYPE, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 #endif
-        texdata = tile->pixmap->samples;
+        start = now ();
+        size = (size_t) tile->w * slice->h * tile->pixmap->n;
+        pbo = stagedbuffer (tile);
+        if (pbo) {
+            glBindBuffer (GL_PIXEL_UNPACK_BUFFER, pbo);
+            texdata = (const void *) (uintptr_t) offset;
+            state.pbo.staged++;
+        }
+        else {
+            texdata = tile->pixmap->samples + offset;
+        }
+        /* rows of opaque (and odd width gray) tiles are not padded */
+        glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
         if (subimage) {
             glTexSubImage2D (TEXT_TYPE, 0, 0, 0, tile->w, slice->h,
-                             state.tex.form, state.tex.ty, texdata+offset);
+                             form, state.tex.ty, texdata);
         }
         else {
-            glTexImage2D (TEXT_TYPE, 0, state.tex.iform, tile->w, slice->h,
-                          0, state.tex.form, state.tex.ty, texdata+offset);
+            glTexImage2D (TEXT_TYPE, 0, iform, tile->w, slice->h,
+                          0, form, state.tex.ty, texdata);
+        }
+        if (pbo) {
+            glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+        state.pbo.uploads++;
+        state.pbo.framebytes += size;
+        state.pbo.frametime += now () - start;
+    }
+}
+
+/* upload traffic is accounted per frame that had any */
+ML0 (endframe (void))
+{
+    state.tex.frame++;
+    if (state.pbo.framebytes) {
+        state.pbo.frames++;
+        state.pbo.bytes += state.pbo.framebytes;
+        state.pbo.time += state.pbo.frametime;
+        state.pbo.worst = fmax (state.pbo.worst, state.pbo.frametime);
+        state.pbo.framebytes = 0;
+        state.pbo.frametime = 0.0;
+    }
+}
+
+/* called as a tile arrives, well before it is drawn: the copy into
+   the buffer is made here and the transfer is left to the driver */
+ML0 (stagetile (value ptr_v))
+{
+    CAMLparam1 (ptr_v);
+    struct tile *tile = parse_pointer (__func__, String_val (ptr_v));
+
+    if (state.pbo.count && !tile->solid && tile->pixmap
+        && !stagedbuffer (tile)) {
+        int i = state.pbo.index++ % state.pbo.count;
+        size_t size = (size_t) tile->w * tile->h * tile->pixmap->n;
+
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, state.pbo.slots[i].id);
+        /* whatever the buffer held is orphaned, this does not wait for
+           an earlier transfer out of it to finish */
+        glBufferData (GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr) size,
+                      tile->pixmap->samples, GL_STREAM_DRAW);
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+        state.pbo.slots[i].tile = tile;
+        state.pbo.slots[i].serial = tile->serial;
+        state.pbo.stagings++;
+    }
+    CAMLreturn0;
+}
+
+ML0 (setpbo (value pbo_v))
+{
+    CAMLparam1 (pbo_v);
+    int count = Bool_val (pbo_v) && state.pbo.usable ? PBOCOUNT : 0;
+
+    if (count && !state.pbo.count) {
+        for (int i = 0; i < count; ++i) {
+            glGenBuffers (1, &state.pbo.slots[i].id);
+        }
+    }
+    else if (!count && state.pbo.count) {
+        for (int i = 0; i < state.pbo.count; ++i) {
+            glDeleteBuffers (1, &state.pbo.slots[i].id);
+            state.pbo.slots[i].tile = NULL;
         }
     }
+    state.pbo.count = count;
+    CAMLreturn0;
 }
 
 ML0 (begintiles (void))
@@ -2123,6 +5086,211 @@ ML0 (endtiles (void))
     glDisable (TEXT_TYPE);
 }
 
+#define RLEMAX 0x7fff
+#define RLERUN 0x8000
+
+static int samepixel (const unsigned char *a, const unsigned char *b, int n)
+{
+    return !memcmp (a, b, n);
+}
+
+/* gives up (returning 0) as soon as the output would pass limit, few
+   distinct neighbours make the stream bigger than the pixels */
+static size_t rlepack (unsigned char *d, const unsigned char *s,
+                       size_t count, int n, size_t limit)
+{
+    unsigned char *d0 = d;
+    size_t i = 0;
+
+    while (i < count) {
+        size_t run = 1;
+        uint16_t word;
+
+        while (i + run < count && run < RLEMAX
+               && samepixel (s + (i + run) * n, s + i * n, n)) {
+            run++;
+        }
+        if (run > 1) {
+            if ((size_t) (d - d0) + 2 + n > limit) {
+                return 0;
+            }
+            word = (uint16_t) (RLERUN | run);
+            memcpy (d, &word, 2);
+            memcpy (d + 2, s + i * n, n);
+            d += 2 + n;
+        }
+        else {
+            /* literals up to the next pair of equal pixels */
+            while (i + run < count && run < RLEMAX
+                   && !(i + run + 1 < count
+                        && samepixel (s + (i + run) * n,
+                                      s + (i + run + 1) * n, n))) {
+                run++;
+            }
+            if ((size_t) (d - d0) + 2 + run * n > limit) {
+                return 0;
+            }
+            word = (uint16_t) run;
+            memcpy (d, &word, 2);
+            memcpy (d + 2, s + i * n, run * n);
+            d += 2 + run * n;
+        }
+        i += run;
+    }
+    return d - d0;
+}
+
+static void rleunpack (unsigned char *d, const unsigned char *s,
+                       size_t size, int n)
+{
+    const unsigned char *end = s + size;
+
+    while (s < end) {
+        uint16_t word;
+        size_t run;
+
+        memcpy (&word, s, 2);
+        s += 2;
+        run = word & RLEMAX;
+        if (word & RLERUN) {
+            for (size_t i = 0; i < run; ++i, d += n) {
+                memcpy (d, s, n);
+            }
+            s += n;
+        }
+        else {
+            memcpy (d, s, run * n);
+            d += run * n;
+            s += run * n;
+        }
+    }
+}
+
+/* brings a packed tile back, with the UI's own context */
+static int unpacktile (struct tile *tile)
+{
+    fz_pixmap *pixmap = NULL;
+    struct packed *packed = tile->packed;
+    double start = now ();
+
+    fz_var (pixmap);
+    fz_try (state.uictx) {
+        pixmap = fz_new_pixmap_with_bbox (state.uictx, packed->colorspace,
+                                          packed->bbox, NULL, packed->alpha);
+    }
+    fz_catch (state.uictx) {
+        return 0;
+    }
+    rleunpack (pixmap->samples, packed->data, packed->size, pixmap->n);
+    tile->pixmap = pixmap;
+    tile->packed = NULL;
+    fz_drop_colorspace (state.uictx, packed->colorspace);
+    free (packed);
+
+    lockmutex (&state.pool.mutex, "unpacktile");
+    state.pool.unpacks++;
+    state.pool.unpacktime += now () - start;
+    unlockmutex (&state.pool.mutex, "unpacktile");
+    return 1;
+}
+
+static int tilesize (struct tile *tile)
+{
+    if (tile->packed) {
+        return (int) tile->packed->size;
+    }
+    return tile->solid ? 0 : tile->w * tile->h * tile->pixmap->n;
+}
+
+/* tiles that left the view but may well come back are kept packed,
+   what the UI is told is the size it should account for now */
+ML (packtile (value ptr_v))
+{
+    CAMLparam1 (ptr_v);
+    size_t raw, limit, size;
+    struct packed *packed, *shrunk;
+    fz_pixmap *pixmap;
+    struct tile *tile = parse_pointer (__func__, String_val (ptr_v));
+
+    pixmap = tile->pixmap;
+    if (tile->packed || tile->solid) {
+        CAMLreturn (Val_int (tilesize (tile)));
+    }
+
+    /* not worth it unless it saves a quarter */
+    raw = (size_t) pixmap->w * pixmap->h * pixmap->n;
+    limit = raw / 4 * 3;
+    packed = malloc (sizeof (*packed) + limit);
+    if (!packed) {
+        err (1, errno, "malloc packed tile (%zu bytes)", limit);
+    }
+    size = rlepack (packed->data, pixmap->samples,
+                    (size_t) pixmap->w * pixmap->h, pixmap->n, limit);
+    if (!size) {
+        free (packed);
+        CAMLreturn (Val_int (tilesize (tile)));
+    }
+
+    shrunk = realloc (packed, sizeof (*packed) + size);
+    if (shrunk) {
+        packed = shrunk;
+    }
+    packed->bbox = fz_pixmap_bbox (state.uictx, pixmap);
+    packed->colorspace = fz_keep_colorspace (state.uictx, pixmap->colorspace);
+    packed->alpha = pixmap->alpha;
+    packed->size = size;
+    tile->packed = packed;
+    tile->pixmap = NULL;
+    fz_drop_pixmap (state.uictx, pixmap);
+
+    lockmutex (&state.pool.mutex, __func__);
+    state.pool.packs++;
+    state.pool.packedin += raw;
+    state.pool.packedout += size;
+    unlockmutex (&state.pool.mutex, __func__);
+    CAMLreturn (Val_int (tilesize (tile)));
+}
+
+ML (unpacktile (value ptr_v))
+{
+    CAMLparam1 (ptr_v);
+    struct tile *tile = parse_pointer (__func__, String_val (ptr_v));
+
+    if (tile->packed) {
+        unpacktile (tile);
+    }
+    CAMLreturn (Val_int (tilesize (tile)));
+}
+
+/* solid tiles are drawn through a 1x1 texture of their own, so that
+   they come out like the others under any texture environment */
+static void drawsolid (struct tile *tile, int x, int y, int w, int h)
+{
+    GLfloat *texcoords = state.texcoords;
+    GLfloat *vertices = state.vertices;
+
+    if (!state.solidtex) {
+        glGenTextures (1, &state.solidtex);
+    }
+    glBindTexture (TEXT_TYPE, state.solidtex);
+    glTexParameteri (TEXT_TYPE, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri (TEXT_TYPE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D (TEXT_TYPE, 0, GL_RGBA8, 1, 1, 0, GL_RGBA,
+                  GL_UNSIGNED_BYTE, tile->color);
+
+    texcoords[0] = 0; texcoords[1] = 0;
+    texcoords[2] = 1; texcoords[3] = 0;
+    texcoords[4] = 0; texcoords[5] = 1;
+    texcoords[6] = 1; texcoords[7] = 1;
+
+    vertices[0] = x;     vertices[1] = y;
+    vertices[2] = x + w; vertices[3] = y;
+    vertices[4] = x;     vertices[5] = y + h;
+    vertices[6] = x + w; vertices[7] = y + h;
+
+    glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+}
+
 ML0 (drawtile (value args_v, value ptr_v))
 {
     CAMLparam2 (args_v, ptr_v);
@@ -2133,45 +5301,53 @@ ML0 (drawtile (value args_v, value ptr_v))
     int tilex = Int_val (Field (args_v, 4));
     int tiley = Int_val (Field (args_v, 5));
     struct tile *tile = parse_pointer (__func__, String_val (ptr_v));
-    int slicey, firstslice;
+    GLfloat scale = tile->scale, ty, tyend;
+
+    if (tile->solid) {
+        drawsolid (tile, dispx, dispy, dispw, disph);
+        CAMLreturn0;
+    }
+    if (tile->packed && !unpacktile (tile)) {
+        CAMLreturn0;
+    }
     struct slice *slice;
     GLfloat *texcoords = state.texcoords;
     GLfloat *vertices = state.vertices;
 
-    firstslice = tiley / tile->sliceheight;
-    slice = &tile->slices[firstslice];
-    slicey = tiley % tile->sliceheight;
-
-    while (disph > 0) {
-        int dh;
-
-        dh = slice->h - slicey;
-        dh = fz_mini (disph, dh);
+    /* coordinates are in full resolution tile space, a coarse preview
+       tile holds one texel per scale x scale block of those */
+    ty = tiley / scale;
+    tyend = (tiley + disph) / scale;
+    for (int i = (int) ty / tile->sliceheight;
+         i < tile->slicecount && ty < tyend; ++i) {
+        GLfloat top, bot;
+
+        slice = &tile->slices[i];
+        top = (GLfloat) i * tile->sliceheight;
+        bot = fminf (top + slice->h, tyend);
         uploadslice (tile, slice);
 
-        texcoords[0] = tilex;       texcoords[1] = slicey;
-        texcoords[2] = tilex+dispw; texcoords[3] = slicey;
-        texcoords[4] = tilex;       texcoords[5] = slicey+dh;
-        texcoords[6] = tilex+dispw; texcoords[7] = slicey+dh;
+        texcoords[0] = tilex / scale;         texcoords[1] = ty - top;
+        texcoords[2] = (tilex+dispw) / scale; texcoords[3] = ty - top;
+        texcoords[4] = tilex / scale;         texcoords[5] = bot - top;
+        texcoords[6] = (tilex+dispw) / scale; texcoords[7] = bot - top;
 
-        vertices[0] = dispx;        vertices[1] = dispy;
-        vertices[2] = dispx+dispw;  vertices[3] = dispy;
-        vertices[4] = dispx;        vertices[5] = dispy+dh;
-        vertices[6] = dispx+dispw;  vertices[7] = dispy+dh;
+        vertices[0] = dispx;        vertices[1] = dispy + ty*scale - tiley;
+        vertices[2] = dispx+dispw;  vertices[3] = vertices[1];
+        vertices[4] = dispx;        vertices[5] = dispy + bot*scale - tiley;
+        vertices[6] = dispx+dispw;  vertices[7] = vertices[5];
 
 #if TEXT_TYPE == GL_TEXTURE_2D
-        for (int i = 0; i < 8; ++i) {
-            texcoords[i] /= ((i & 1) == 0 ? tile->w : slice->h);
+        for (int j = 0; j < 8; j += 2) {
+            texcoords[j] /= tile->w;
+            texcoords[j+1] /= slice->h;
         }
 #endif
 
         glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
-        dispy += dh;
-        disph -= dh;
-        slice++;
-        ARSERT (!(slice - tile->slices >= tile->slicecount && disph > 0));
-        slicey = 0;
+        ty = bot;
     }
+    ARSERT (ty >= tyend || tile->scale > 1);
     CAMLreturn0;
 }
 
@@ -2195,12 +5371,7 @@ ML (postprocess (value ptr_v, value hlmask_v,
         goto done;
     }
 
-    if (trylock (__func__)) {
-        noff = -1;
-        goto done;
-    }
-
-    ensureannots (page);
+    lockpage (page, __func__);
     if (hlmask & 1) {
         highlightlinks (page, xoff, yoff);
     }
@@ -2209,10 +5380,10 @@ ML (postprocess (value ptr_v, value hlmask_v,
                          chars, STTI (clen), hfsize);
         noff = page->slinkcount;
     }
-    if (page->tgen == state.gen) {
+    if (page->tgen == page->sgen) {
         showsel (page, xoff, yoff);
     }
-    unlock (__func__);
+    unlockpage (page, __func__);
 
  done:
     CAMLreturn (Val_int (noff));
@@ -2220,37 +5391,14 @@ ML (postprocess (value ptr_v, value hlmask_v,
 
 static struct annot *getannot (struct page *page, int x, int y)
 {
-    fz_point p;
-    fz_matrix ctm;
-    const fz_matrix *tctm;
-    pdf_document *pdf = pdf_specifics (state.ctx, state.doc);
-
-    if (!page->annots) {
-        return NULL;
-    }
-
-    if (pdf) {
-        trimctm (pdf_page_from_fz_page (state.ctx, page->fzpage), page->pdimno);
-        tctm = &state.pagedims[page->pdimno].tctm;
-    }
-    else {
-        tctm = &fz_identity;
-    }
-
-    p.x = x;
-    p.y = y;
+    fz_point p = { .x = x, .y = y };
 
-    ctm = fz_concat (*tctm, state.pagedims[page->pdimno].ctm);
-    ctm = fz_invert_matrix (ctm);
-    p = fz_transform_point (p, ctm);
+    p = fz_transform_point (p, fz_invert_matrix (page->ctm));
+    for (int i = 0; i < page->annotcount; ++i) {
+        struct annot *a = &page->annots[i];
 
-    if (pdf) {
-        for (int i = 0; i < page->annotcount; ++i) {
-            struct annot *a = &page->annots[i];
-            if (fz_is_point_inside_rect (p, pdf_bound_annot (state.ctx,
-                                                             a->annot))) {
-                return a;
-            }
+        if (fz_is_point_inside_rect (p, fz_rect_from_irect (a->bbox))) {
+            return a;
         }
     }
     return NULL;
@@ -2261,8 +5409,7 @@ static fz_link *getlink (struct page *page, int x, int y)
     fz_link *link;
     fz_point p = { .x = x, .y = y };
 
-    ensureslinks (page);
-    p = fz_transform_point (p, fz_invert_matrix (pagectm (page)));
+    p = fz_transform_point (p, fz_invert_matrix (page->ctm));
 
     for (link = page->links; link; link = link->next) {
         if (fz_is_point_inside_rect (p, link->rect)) {
@@ -2272,22 +5419,23 @@ static fz_link *getlink (struct page *page, int x, int y)
     return NULL;
 }
 
+/* the text layer follows the links into whatever view they were
+   refreshed for; built on the UI's own context under the page lock */
 static void ensuretext (struct page *page)
 {
-    if (state.gen != page->tgen) {
+    if (page->sgen != page->tgen) {
         droptext (page);
-        page->tgen = state.gen;
+        page->tgen = page->sgen;
     }
     if (!page->text) {
         fz_device *tdev;
 
-        page->text = fz_new_stext_page (state.ctx,
-                                        state.pagedims[page->pdimno].mediabox);
-        tdev = fz_new_stext_device (state.ctx, page->text, 0);
-        fz_run_display_list (state.ctx, page->dlist,
-                             tdev, pagectm (page), fz_infinite_rect, NULL);
-        fz_close_device (state.ctx, tdev);
-        fz_drop_device (state.ctx, tdev);
+        page->text = fz_new_stext_page (state.uictx, page->mediabox);
+        tdev = fz_new_stext_device (state.uictx, page->text, 0);
+        fz_run_display_list (state.uictx, page->dlist,
+                             tdev, page->ctm, fz_infinite_rect, NULL);
+        fz_close_device (state.uictx, tdev);
+        fz_drop_device (state.uictx, tdev);
     }
 }
 
@@ -2351,8 +5499,7 @@ ML (findlink (value ptr_v, value dir_v))
 
     page = parse_pointer (__func__, String_val (ptr_v));
     ret_v = Val_int (0);
-    lock (__func__);
-    ensureslinks (page);
+    lockpage (page, __func__);
 
     if (Is_block (dir_v)) {
         dirtag = Tag_val (dir_v);
@@ -2454,7 +5601,7 @@ ML (findlink (value ptr_v, value dir_v))
         Field (ret_v, 0) = Val_int (found - page->slinks);
     }
 
-    unlock (__func__);
+    unlockpage (page, __func__);
     CAMLreturn (ret_v);
 }
 
@@ -2470,8 +5617,7 @@ ML (getlink (value ptr_v, value n_v))
     ret_v = Val_int (0);
     page = parse_pointer (__func__, String_val (ptr_v));
 
-    lock (__func__);
-    ensureslinks (page);
+    lockpage (page, __func__);
     if (!page->slinkcount || n > page->slinkcount) goto unlock;
     slink = &page->slinks[n];
     if (slink->tag == SLINK) {
@@ -2481,8 +5627,8 @@ ML (getlink (value ptr_v, value n_v))
         Field (ret_v, 0) = str_v;
     }
     else {
-        int ty = pdf_annot_type (state.ctx, slink->u.annot)
-            == PDF_ANNOT_FILE_ATTACHMENT ? Ufileannot : Utextannot;
+        int ty = slink->type == PDF_ANNOT_FILE_ATTACHMENT
+            ? Ufileannot : Utextannot;
 
         ret_v = caml_alloc_small (1, ty);
         tup_v = caml_alloc_tuple (2);
@@ -2491,7 +5637,7 @@ ML (getlink (value ptr_v, value n_v))
         Field (tup_v, 1) = n_v;
     }
 unlock:
-    unlock (__func__);
+    unlockpage (page, __func__);
     CAMLreturn (ret_v);
 }
 
@@ -2506,8 +5652,7 @@ ML (getlinkn (value ptr_v, value c_v, value n_v, value noff_v))
     mlsize_t clen = caml_string_length (c_v);
     page = parse_pointer (__func__, String_val (ptr_v));
 
-    lock (__func__);
-    ensureslinks (page);
+    lockpage (page, __func__);
 
     ret_v = Val_int (-page->slinkcount);
     for (int i = 0; i < page->slinkcount; ++i) {
@@ -2518,18 +5663,22 @@ ML (getlinkn (value ptr_v, value c_v, value n_v, value noff_v))
         }
     }
 
-    unlock (__func__);
+    unlockpage (page, __func__);
     CAMLreturn (ret_v);
 }
 
+/* annotations are read from the document, these give None (or false)
+   instead of waiting while it is busy */
 ML (gettextannot (value ptr_v, value n_v))
 {
     CAMLparam2 (ptr_v, n_v);
-    CAMLlocal1 (ret_v);
+    CAMLlocal2 (ret_v, str_v);
     pdf_document *pdf;
     const char *contents = "";
 
-    lock (__func__);
+    if (trylock (__func__)) {
+        CAMLreturn (Val_int (0));
+    }
     pdf = pdf_specifics (state.ctx, state.doc);
     if (pdf) {
         struct page *page;
@@ -2541,29 +5690,37 @@ ML (gettextannot (value ptr_v, value n_v))
         annot = slink->u.annot;
         contents = pdf_annot_contents (state.ctx, annot);
     }
+    str_v = caml_copy_string (contents);
     unlock (__func__);
-    ret_v = caml_copy_string (contents);
+    ret_v = caml_alloc_small (1, 0);
+    Field (ret_v, 0) = str_v;
     CAMLreturn (ret_v);
 }
 
 ML (getfileannot (value ptr_v, value n_v))
 {
     CAMLparam2 (ptr_v, n_v);
-    CAMLlocal1 (ret_v);
+    CAMLlocal2 (ret_v, str_v);
 
-    lock (__func__);
+    if (trylock (__func__)) {
+        CAMLreturn (Val_int (0));
+    }
 
     struct page *page = parse_pointer (__func__, String_val (ptr_v));
     struct slink *slink = &page->slinks[Int_val (n_v)];
     pdf_obj *fs = pdf_dict_get (state.ctx,
                                 pdf_annot_obj (state.ctx, slink->u.annot),
                                 PDF_NAME (FS));
-    ret_v = caml_copy_string (pdf_embedded_file_name (state.ctx, fs));
+    str_v = caml_copy_string (pdf_embedded_file_name (state.ctx, fs));
 
     unlock (__func__);
+    ret_v = caml_alloc_small (1, 0);
+    Field (ret_v, 0) = str_v;
     CAMLreturn (ret_v);
 }
 
+/* the user has already picked where to save, this waits for the
+   document instead of giving up like the hover accessors */
 ML0 (savefileannot (value ptr_v, value n_v, value path_v))
 {
     CAMLparam3 (ptr_v, n_v, path_v);
@@ -2585,6 +5742,7 @@ ML0 (savefileannot (value ptr_v, value n_v, value path_v))
         printd ("emsg saving '%s': %s", path, fz_caught_message (state.ctx));
     }
     unlock (__func__);
+    CAMLreturn0;
 }
 
 ML (getlinkrect (value ptr_v, value n_v))
@@ -2596,15 +5754,14 @@ ML (getlinkrect (value ptr_v, value n_v))
 
     page = parse_pointer (__func__, String_val (ptr_v));
     ret_v = caml_alloc_tuple (4);
-    lock (__func__);
-    ensureslinks (page);
+    lockpage (page, __func__);
 
     slink = &page->slinks[Int_val (n_v)];
     Field (ret_v, 0) = Val_int (slink->bbox.x0);
     Field (ret_v, 1) = Val_int (slink->bbox.y0);
     Field (ret_v, 2) = Val_int (slink->bbox.x1);
     Field (ret_v, 3) = Val_int (slink->bbox.y1);
-    unlock (__func__);
+    unlockpage (page, __func__);
     CAMLreturn (ret_v);
 }
 
@@ -2617,23 +5774,17 @@ ML (whatsunder (value ptr_v, value x_v, value y_v))
     struct page *page;
     const char *ptr = String_val (ptr_v);
     int x = Int_val (x_v), y = Int_val (y_v);
-    struct pagedim *pdim;
 
     ret_v = Val_int (0);
-    if (trylock (__func__)) {
-        goto done;
-    }
-
     page = parse_pointer (__func__, ptr);
-    pdim = &state.pagedims[page->pdimno];
-    x += pdim->bounds.x0;
-    y += pdim->bounds.y0;
+    lockpage (page, __func__);
+    x += page->bounds.x0;
+    y += page->bounds.y0;
 
     annot = getannot (page, x, y);
     if (annot) {
         int i, n = -1, ty;
 
-        ensureslinks (page);
         for (i = 0; i < page->slinkcount; ++i) {
             if (page->slinks[i].tag == SANNOT
                 && page->slinks[i].u.annot == annot->annot) {
@@ -2641,8 +5792,8 @@ ML (whatsunder (value ptr_v, value x_v, value y_v))
                 break;
             }
         }
-        ty = pdf_annot_type (state.ctx, annot->annot)
-            == PDF_ANNOT_FILE_ATTACHMENT ? Ufileannot : Utextannot;
+        ty = annot->type == PDF_ANNOT_FILE_ATTACHMENT
+            ? Ufileannot : Utextannot;
 
         ret_v = caml_alloc_small (1, ty);
         tup_v = caml_alloc_tuple (2);
@@ -2683,8 +5834,9 @@ ML (whatsunder (value ptr_v, value x_v, value y_v))
 
                 for (ch = line->first_char; ch; ch = ch->next) {
                     if (!fz_is_point_inside_quad (p, ch->quad)) {
-                        const char *n2 = fz_font_name (state.ctx, ch->font);
-                        FT_FaceRec *face = fz_font_ft_face (state.ctx,
+                        const char *n2 = fz_font_name (state.uictx,
+                                                       ch->font);
+                        FT_FaceRec *face = fz_font_ft_face (state.uictx,
                                                             ch->font);
 
                         if (!n2) {
@@ -2720,9 +5872,7 @@ ML (whatsunder (value ptr_v, value x_v, value y_v))
         }
     }
 unlock:
-    unlock (__func__);
-
-done:
+    unlockpage (page, __func__);
     CAMLreturn (ret_v);
 }
 
@@ -2731,16 +5881,11 @@ ML0 (clearmark (value ptr_v))
     CAMLparam1 (ptr_v);
     struct page *page;
 
-    if (trylock (__func__)) {
-        goto done;
-    }
-
     page = parse_pointer (__func__, String_val (ptr_v));
+    lockpage (page, __func__);
     page->fmark = NULL;
     page->lmark = NULL;
-
-    unlock (__func__);
- done:
+    unlockpage (page, __func__);
     CAMLreturn0;
 }
 
@@ -2756,17 +5901,12 @@ ML (markunder (value ptr_v, value x_v, value y_v, value mark_v))
     struct page *page;
     fz_stext_line *line;
     fz_stext_block *block;
-    struct pagedim *pdim;
     int mark = Int_val (mark_v);
     fz_point p = { .x = Int_val (x_v), .y = Int_val (y_v) };
 
     ret_v = Val_bool (0);
-    if (trylock (__func__)) {
-        goto done;
-    }
-
     page = parse_pointer (__func__, String_val (ptr_v));
-    pdim = &state.pagedims[page->pdimno];
+    lockpage (page, __func__);
 
     ensuretext (page);
 
@@ -2777,8 +5917,8 @@ ML (markunder (value ptr_v, value x_v, value y_v, value mark_v))
         goto unlock;
     }
 
-    p.x += pdim->bounds.x0;
-    p.y += pdim->bounds.y0;
+    p.x += page->bounds.x0;
+    p.y += page->bounds.y0;
 
     for (block = page->text->first_block; block; block = block->next) {
         if (block->type != FZ_STEXT_BLOCK_TEXT) {
@@ -2843,9 +5983,7 @@ unlock:
         page->fmark = NULL;
         page->lmark = NULL;
     }
-    unlock (__func__);
-
-done:
+    unlockpage (page, __func__);
     CAMLreturn (ret_v);
 }
 
@@ -2855,19 +5993,14 @@ ML (rectofblock (value ptr_v, value x_v, value y_v))
     CAMLlocal2 (ret_v, res_v);
     fz_rect *b = NULL;
     struct page *page;
-    struct pagedim *pdim;
     fz_stext_block *block;
     fz_point p = { .x = Int_val (x_v), .y = Int_val (y_v) };
 
     ret_v = Val_int (0);
-    if (trylock (__func__)) {
-        goto done;
-    }
-
     page = parse_pointer (__func__, String_val (ptr_v));
-    pdim = &state.pagedims[page->pdimno];
-    p.x += pdim->bounds.x0;
-    p.y += pdim->bounds.y0;
+    lockpage (page, __func__);
+    p.x += page->bounds.x0;
+    p.y += page->bounds.y0;
 
     ensuretext (page);
 
@@ -2899,9 +6032,7 @@ ML (rectofblock (value ptr_v, value x_v, value y_v))
         Store_double_field (res_v, 3, (double) b->y1);
         Field (ret_v, 0) = res_v;
     }
-    unlock (__func__);
-
- done:
+    unlockpage (page, __func__);
     CAMLreturn (ret_v);
 }
 
@@ -2909,25 +6040,20 @@ ML0 (seltext (value ptr_v, value rect_v))
 {
     CAMLparam2 (ptr_v, rect_v);
     struct page *page;
-    struct pagedim *pdim;
     int x0, x1, y0, y1;
     fz_stext_char *ch;
     fz_stext_line *line;
     fz_stext_block *block;
     fz_stext_char *fc, *lc;
 
-    if (trylock (__func__)) {
-        goto done;
-    }
-
     page = parse_pointer (__func__, String_val (ptr_v));
+    lockpage (page, __func__);
     ensuretext (page);
 
-    pdim = &state.pagedims[page->pdimno];
-    x0 = Int_val (Field (rect_v, 0)) + pdim->bounds.x0;
-    y0 = Int_val (Field (rect_v, 1)) + pdim->bounds.y0;
-    x1 = Int_val (Field (rect_v, 2)) + pdim->bounds.x0;
-    y1 = Int_val (Field (rect_v, 3)) + pdim->bounds.y0;
+    x0 = Int_val (Field (rect_v, 0)) + page->bounds.x0;
+    y0 = Int_val (Field (rect_v, 1)) + page->bounds.y0;
+    x1 = Int_val (Field (rect_v, 2)) + page->bounds.x0;
+    y1 = Int_val (Field (rect_v, 3)) + page->bounds.y0;
 
     if (y0 > y1) {
         int t = y0;
@@ -2968,9 +6094,7 @@ ML0 (seltext (value ptr_v, value rect_v))
     page->fmark = fc;
     page->lmark = lc;
 
-    unlock (__func__);
-
- done:
+    unlockpage (page, __func__);
     CAMLreturn0;
 }
 
@@ -3071,15 +6195,10 @@ ML (hassel (value ptr_v))
     CAMLlocal1 (ret_v);
     struct page *page;
 
-    ret_v = Val_bool (0);
-    if (trylock (__func__)) {
-        goto done;
-    }
-
     page = parse_pointer (__func__, String_val (ptr_v));
+    lockpage (page, __func__);
     ret_v = Val_bool (page->fmark && page->lmark);
-    unlock (__func__);
- done:
+    unlockpage (page, __func__);
     CAMLreturn (ret_v);
 }
 
@@ -3093,11 +6212,8 @@ ML0 (copysel (value fd_v, value ptr_v))
     fz_stext_block *block;
     int fd = Int_val (fd_v);
 
-    if (trylock (__func__)) {
-        goto done;
-    }
-
     page = parse_pointer (__func__, String_val (ptr_v));
+    lockpage (page, __func__);
 
     if (!page->fmark || !page->lmark) {
         printd ("emsg nothing to copy on page %d", page->pageno);
@@ -3149,9 +6265,8 @@ close:
         }
     }
 unlock:
-    unlock (__func__);
+    unlockpage (page, __func__);
 
-done:
     if (fd >= 0) {
         if (close (fd)) {
             printd ("emsg failed to close sel pipe: %d(%s)",
@@ -3302,14 +6417,108 @@ ML0 (setaalevel (value level_v))
     CAMLreturn0;
 }
 
+ML0 (setbuckets (value w_v, value h_v))
+{
+    CAMLparam2 (w_v, h_v);
+
+    lockmutex (&state.pool.mutex, __func__);
+    state.bucketw = Int_val (w_v);
+    state.bucketh = Int_val (h_v);
+    unlockmutex (&state.pool.mutex, __func__);
+    CAMLreturn0;
+}
+
+ML0 (setbandedtiles (value banded_v))
+{
+    CAMLparam1 (banded_v);
+
+    lockmutex (&state.pool.mutex, __func__);
+    state.bandedtiles = Bool_val (banded_v);
+    unlockmutex (&state.pool.mutex, __func__);
+    CAMLreturn0;
+}
+
+/* y = 255 - x * (1 - tint) when inverting, then y = 255 (y / 255)^gamma */
+ML0 (setbake (value active_v, value invert_v, value gamma_v, value tint_v))
+{
+    CAMLparam4 (active_v, invert_v, gamma_v, tint_v);
+    struct bake b, *bake = &b;
+    int invert = Bool_val (invert_v);
+    double gamma = Double_val (gamma_v);
+    double tint[4];
+
+    for (int i = 0; i < 3; ++i) {
+        tint[i] = Double_val (Field (tint_v, i));
+    }
+    tint[3] = (tint[0] + tint[1] + tint[2]) / 3.0;
+
+    bake->active = Bool_val (active_v) && (invert || gamma != 1.0);
+    bake->affine = gamma == 1.0;
+    for (int ch = 0; ch < 4; ++ch) {
+        int k = (int) (128.0 * (1.0 - fz_clamp (tint[ch], 0, 1)) + 0.5);
+
+        bake->mul[ch] = (short) (invert ? -k : 128);
+        bake->add[ch] = (short) (invert ? 255 : 0);
+        for (int x = 0; x < 256; ++x) {
+            int v = x * bake->mul[ch];
+
+            /* the same flooring shift as the vector code */
+            v = bake->add[ch] + (v >= 0 ? v >> 7 : -((-v + 127) >> 7));
+            if (!bake->affine) {
+                v = (int) (255.0 * pow (v / 255.0, gamma) + 0.5);
+            }
+            bake->lut[ch][x] = (unsigned char) fz_clampi (v, 0, 255);
+        }
+    }
+    /* tiles are queued under the pool mutex, not the document */
+    lockmutex (&state.pool.mutex, __func__);
+    state.bake = b;
+    unlockmutex (&state.pool.mutex, __func__);
+    CAMLreturn0;
+}
+
+ML0 (setsharepages (value share_v))
+{
+    CAMLparam1 (share_v);
+
+    lockmutex (&state.pool.mutex, __func__);
+    state.sharepages = Bool_val (share_v);
+    unlockmutex (&state.pool.mutex, __func__);
+    CAMLreturn0;
+}
+
+ML0 (settilebudget (value ms_v))
+{
+    CAMLparam1 (ms_v);
+
+    lockmutex (&state.pool.mutex, __func__);
+    state.pool.budget = Int_val (ms_v) / 1000.0;
+    unlockmutex (&state.pool.mutex, __func__);
+    CAMLreturn0;
+}
+
+/* the recycled pixmaps get a share of the pixmap cache size, the
+   next pixmap to come back trims the pool to it */
+ML0 (setpiglimit (value memlimit_v))
+{
+    CAMLparam1 (memlimit_v);
+
+    lockmutex (&state.pool.mutex, __func__);
+    state.pigs.limit = (size_t) Long_val (memlimit_v) / PIGSHARE;
+    unlockmutex (&state.pool.mutex, __func__);
+    CAMLreturn0;
+}
+
 ML0 (setpapercolor (value rgba_v))
 {
     CAMLparam1 (rgba_v);
 
+    lockmutex (&state.pool.mutex, __func__);
     state.papercolor[0] = (float) Double_val (Field (rgba_v, 0));
     state.papercolor[1] = (float) Double_val (Field (rgba_v, 1));
     state.papercolor[2] = (float) Double_val (Field (rgba_v, 2));
     state.papercolor[3] = (float) Double_val (Field (rgba_v, 3));
+    unlockmutex (&state.pool.mutex, __func__);
     CAMLreturn0;
 }
 
@@ -3398,7 +6607,7 @@ ML (project (value ptr_v, value pageno_v, value pdimno_v, value x_v, value y_v))
     lock (__func__);
 
     if (!*s) {
-        page = loadpage (pageno, pdimno);
+        page = loadpage (state.ctx, pageno, pdimno, NULL);
     }
     else {
         page = parse_pointer (__func__, String_val (ptr_v));
@@ -3540,9 +6749,24 @@ ML (llpp_version (void))
     return caml_copy_string (llpp_version);
 }
 
+static int isrenderthread (void)
+{
+    pthread_t self = pthread_self ();
+
+    if (pthread_equal (self, state.thread)) {
+        return 1;
+    }
+    for (int i = 0; i < state.pool.count; ++i) {
+        if (pthread_equal (self, state.pool.threads[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static void diag_callback (void *user, const char *message)
 {
-    if (pthread_equal (pthread_self (), state.thread)) {
+    if (isrenderthread ()) {
         printd ("emsg %s %s", (char *) user, message);
     }
     else {
@@ -3583,11 +6807,22 @@ ML0 (setdcf (value path_v))
     }
 }
 
+static void lockfz (void UNUSED_ATTR *user, int lockno)
+{
+    lockmutex (&state.fzmutexes[lockno], "fz");
+}
+
+static void unlockfz (void UNUSED_ATTR *user, int lockno)
+{
+    unlockmutex (&state.fzmutexes[lockno], "fz");
+}
+
 ML (init (value csock_v, value params_v))
 {
     CAMLparam2 (csock_v, params_v);
     CAMLlocal2 (trim_v, fuzz_v);
-    int ret, texcount, colorspace, mustoresize, redirstderr;
+    int ret, texcount, colorspace, mustoresize, redirstderr, renderthreads;
+    fz_locks_context locks = { .lock = lockfz, .unlock = unlockfz };
     const char *fontpath;
     const char *ext = TEXT_TYPE == GL_TEXTURE_2D
         ? "texture_non_power_of_two"
@@ -3606,6 +6841,7 @@ ML (init (value csock_v, value params_v))
     colorspace          = Int_val (Field (params_v, 6));
     fontpath            = String_val (Field (params_v, 7));
     redirstderr         = Bool_val (Field (params_v, 8));
+    renderthreads       = Int_val (Field (params_v, 9));
 
     if (redirstderr) {
         if (pipe (state.pfds)) {
@@ -3638,13 +6874,21 @@ ML (init (value csock_v, value params_v))
     }
 #endif
 
-    state.ctx = fz_new_context (NULL, NULL, mustoresize);
+    for (int i = 0; i < FZ_LOCK_MAX; ++i) {
+        ret = pthread_mutex_init (&state.fzmutexes[i], NULL);
+        if (ret) {
+            errx (1, "pthread_mutex_init: %d(%s)", ret, strerror (ret));
+        }
+    }
+    state.ctx = fz_new_context (NULL, &locks, mustoresize);
     fz_register_document_handlers (state.ctx);
     if (redirstderr) {
         fz_set_error_callback (state.ctx, diag_callback, "[e]");
         fz_set_warning_callback (state.ctx, diag_callback, "[w]");
     }
     fz_install_load_system_font_funcs (state.ctx, NULL, NULL, lsff);
+    state.uictx = fz_clone_context (state.ctx);
+    state.cmdctx = fz_clone_context (state.ctx);
 
     state.trimmargins = Bool_val (Field (trim_v, 0));
     fuzz_v            = Field (trim_v, 1);
@@ -3670,7 +6914,10 @@ ML (init (value csock_v, value params_v))
     }
 
     realloctexts (texcount);
+    state.pbo.usable = !!strstr ((const char *) glGetString (GL_EXTENSIONS),
+                                 "pixel_buffer_object");
     makestippletex ();
+    startpool (renderthreads);
 
     ret = pthread_create (&state.thread, NULL, mainloop, NULL);
     if (ret) {
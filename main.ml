@@ -16,6 +16,8 @@ module U = struct
   let settrim       = '\033'
   let sliceh        = '\034'
   let interrupt     = '\035'
+  let tiles         = '\036'
+  let cost          = '\037'
   let pgscale h     = truncate (float h *. conf.pgscale)
   let nogeomcmds    = function | s, [] -> emptystr s | _ -> false
   let maxy ()       = !S.maxy - if conf.maxhfit then !S.winh else 0
@@ -77,7 +79,7 @@ let launchpath () =
        adderrfmt "spawn" "failed to execute `%s': %s" cmd @@ exntos exn
     | _pid -> ()
 
-let getopaque pageno = Hashtbl.find S.pagemap (pageno, !S.gen)
+let getopaque pageno = Hashtbl.find S.pagemap pageno
 
 let pagetranslatepoint l x y =
   let dy = y - l.pagedispy in
@@ -166,9 +168,13 @@ let undertext = function
   | Ulinkuri s -> s
   | Utext s -> "font: " ^ s
   | Utextannot (opaque, slinkindex) ->
-     "text annotation: " ^ Ffi.gettextannot opaque slinkindex
+     "text annotation: " ^ (match Ffi.gettextannot opaque slinkindex with
+                            | Some s -> s
+                            | None -> "(document busy)")
   | Ufileannot (opaque, slinkindex) ->
-     "file annotation: " ^ Ffi.getfileannot opaque slinkindex
+     "file annotation: " ^ (match Ffi.getfileannot opaque slinkindex with
+                            | Some s -> s
+                            | None -> "(document busy)")
 
 let updateunder x y =
   match getunder x y with
@@ -359,22 +365,119 @@ let itertiles l f =
   if l.pagevw > 0 && l.pagevh > 0
   then rowloop row tiley l.pagedispy l.pagevh
 
+(* pages whose display lists hash the same (see sharetiles) keep
+   their tiles under the number of the first of them *)
+let twin n =
+  match Hashtbl.find_opt S.twins n with
+  | Some m -> m
+  | None -> n
+
 let gettileopaque l col row =
-  let key = l.pageno, !S.gen, conf.colorspace,
+  let key = twin l.pageno, !S.gen, conf.colorspace,
             conf.angle, l.pagew, l.pageh, col, row in
-  Hashtbl.find_opt S.tilemap key
+  let tile = Hashtbl.find_opt S.tilemap key in
+  if tile != None && twin l.pageno != l.pageno
+  then Hashtbl.replace S.twinhits
+         (l.pageno, !S.gen, conf.colorspace,
+          conf.angle, l.pagew, l.pageh, col, row) ();
+  tile
+
+(* moving a tile to the back of the LRU (or out of it) leaves its old
+   entry in place to be skipped later, the queue is only compacted once
+   most of it is dead *)
+let lrulive (key, stamp) =
+  Hashtbl.find_opt S.lrustamps key = Some stamp
+
+let lrupush key =
+  incr S.lrustamp;
+  Hashtbl.replace S.lrustamps key !S.lrustamp;
+  Queue.push (key, !S.lrustamp) S.tilelru;
+  if Queue.length S.tilelru > 2 * Hashtbl.length S.lrustamps + 64
+  then (
+    let live = Queue.create () in
+    Queue.iter (fun item ->
+        if lrulive item then Queue.push item live) S.tilelru;
+    Queue.clear S.tilelru;
+    Queue.transfer live S.tilelru
+  )
+
+let droptile key =
+  match Hashtbl.find_opt S.tilemap key with
+  | Some (p, s, _) ->
+     wcmd1 U.freetile p;
+     S.memused := !S.memused - s;
+     Hashtbl.remove S.tilemap key;
+     Hashtbl.remove S.previews key;
+     Hashtbl.remove S.packed key;
+     Hashtbl.remove S.drafts key;
+     Hashtbl.remove S.lrustamps key
+  | None -> ()
 
 let puttileopaque l col row gen colorspace angle opaque size elapsed =
-  let key = l.pageno, gen, colorspace, angle, l.pagew, l.pageh, col, row in
+  let key =
+    twin l.pageno, gen, colorspace, angle, l.pagew, l.pageh, col, row in
+  (* a preview of the tile gives way to the real thing *)
+  droptile key;
   Hashtbl.add S.tilemap key (opaque, size, elapsed)
 
+(* a packed tile that comes back into view is inflated before drawing,
+   and counts at its full size again *)
+let unpacktile key opaque =
+  if Hashtbl.mem S.packed key
+  then (
+    Hashtbl.remove S.packed key;
+    let size = Ffi.unpacktile opaque in
+    match Hashtbl.find_opt S.tilemap key with
+    | Some (p, s, t) ->
+       S.memused := !S.memused - s + size;
+       Hashtbl.replace S.tilemap key (p, size, t)
+    | None -> ()
+  )
+
+(* a coarse preview stands in for the tile until the real one arrives,
+   it does not count as having the tile *)
+let tilepreviewed l col row =
+  let key = twin l.pageno, !S.gen, conf.colorspace,
+            conf.angle, l.pagew, l.pageh, col, row in
+  Hashtbl.mem S.previews key
+
+(* a draft made while the view was moving is redone once it settles *)
+let tiledraft l col row =
+  let key = twin l.pageno, !S.gen, conf.colorspace,
+            conf.angle, l.pagew, l.pageh, col, row in
+  not !S.moving && Hashtbl.mem S.drafts key
+
+(* the finished bands of a tile that is still being rendered *)
+let drawpartial l col row x y tilex tiley w h =
+  let key = twin l.pageno, !S.gen, conf.colorspace,
+            conf.angle, l.pagew, l.pageh, col, row in
+  match Hashtbl.find_opt S.partials key with
+  | Some (opaque, bands) ->
+     List.iter (fun (y0, y1) ->
+         let y0 = max y0 tiley
+         and y1 = min y1 (tiley + h) in
+         if y0 < y1
+         then Ffi.drawtile (x, y + y0 - tiley, w, y1 - y0, tilex, y0) opaque
+       ) bands
+  | None -> ()
+
+let droppartial id =
+  match Hashtbl.find_opt S.requests id with
+  | Some (Rtile (l, cs, angle, gen, col, row, _, _)) ->
+     Hashtbl.remove S.partials
+       (twin l.pageno, gen, cs, angle, l.pagew, l.pageh, col, row)
+  | Some (Rpage _) | None -> ()
+
 let drawtiles l color =
-  let texe e = if conf.invert then GlTex.env (`mode e) in
+  let texe e =
+    if conf.invert && not conf.bakecolors then GlTex.env (`mode e) in
   GlDraw.color color;
   Ffi.begintiles ();
   let f col row x y tilex tiley w h =
     match gettileopaque l col row with
     | Some (opaque, _, t) ->
+       unpacktile (twin l.pageno, !S.gen, conf.colorspace,
+                   conf.angle, l.pagew, l.pageh, col, row) opaque;
        let params = x, y, w, h, tilex, tiley in
        texe `blend;
        Ffi.drawtile params opaque;
@@ -418,6 +521,9 @@ let drawtiles l color =
        );
        GlDraw.color color;
        Ffi.begintiles ();
+       texe `blend;
+       drawpartial l col row x y tilex tiley w h;
+       texe `modulate;
   in
   itertiles l f;
   Ffi.endtiles ()
@@ -458,17 +564,136 @@ let tileready l x y =
   tilevisible1 l x y &&
     gettileopaque l (x/conf.tilew) (y/conf.tileh) != None
 
+let canrequest () = Hashtbl.length S.requests < conf.pipelinedepth
+
+let request r =
+  incr S.reqid;
+  Hashtbl.add S.requests !S.reqid r;
+  !S.reqid
+
+let requested f = Hashtbl.fold (fun _ r found -> found || f r) S.requests false
+
+let pagerequested pageno =
+  requested (function
+      | Rpage (l, gen) -> l.pageno = pageno && gen = !S.gen
+      | Rtile _ -> false
+    )
+
+let tilerequested l col row =
+  requested (function
+      | Rtile (l', cs, angle, gen, col', row', tilew, tileh) ->
+         twin l'.pageno = twin l.pageno && col' = col && row' = row
+         && l'.pagew = l.pagew && l'.pageh = l.pageh
+         && gen = !S.gen && cs = conf.colorspace && angle = conf.angle
+         && tilew = conf.tilew && tileh = conf.tileh
+      | Rpage _ -> false
+    )
+
+(* what pages took to load (seconds) and to render (milliseconds per
+   megapixel, averaged) is kept per document in page-costs, the next
+   visit starts the expensive ones earlier *)
+let notecost n f =
+  let c =
+    match Hashtbl.find_opt S.pagecosts n with
+    | Some c -> c
+    | None -> (0.0, 0.0)
+  in
+  Hashtbl.replace S.pagecosts n (f c)
+
+let notetilecost n w h t =
+  if t > 0.0 && w > 0 && h > 0
+  then
+    let r = t *. 1e9 /. float (w*h) in
+    notecost n (fun (p, r') ->
+        p, if r' = 0.0 then r else 0.7 *. r' +. 0.3 *. r)
+
+let loadcost n =
+  match Hashtbl.find_opt S.pagecosts n with
+  | Some (p, _) -> p
+  | None -> 0.0
+
+(* expected milliseconds for a whole tile of the page *)
+let tilecost n =
+  match Hashtbl.find_opt S.pagecosts n with
+  | Some (_, r) -> r *. float (conf.tilew * conf.tileh) /. 1e6
+  | None -> 0.0
+
+(* only the most expensive pages are worth remembering *)
+let storecosts () =
+  let costs =
+    Hashtbl.fold (fun n (p, r) accu -> (r, p, n) :: accu) S.pagecosts []
+    |> List.sort (fun a b -> compare b a)
+  in
+  let b = Buffer.create 64 in
+  List.iteri (fun i (r, p, n) ->
+      if i < 256
+      then Printf.bprintf b "%s%d:%.3f:%.1f" (if i = 0 then E.s else " ") n p r
+    ) costs;
+  conf.pagecosts <- Buffer.contents b
+
+let loadcosts () =
+  Hashtbl.clear S.pagecosts;
+  List.iter (fun s ->
+      match Scanf.sscanf s "%d:%f:%f" (fun n p r -> n, p, r) with
+      | n, p, r -> Hashtbl.replace S.pagecosts n (p, r)
+      | exception _ -> ()
+    ) (String.split_on_char ' ' conf.pagecosts)
+
+(* lower is more urgent: visible tiles from the centre of the view
+   outwards, then the rest of the preloaded ones, then whatever else;
+   among the preloaded ones a millisecond of expected rendering counts
+   as much as 16 pixels of distance *)
+let tileprio preloaded l col row =
+  let x = col*conf.tilew + conf.tilew/2 - l.pagex - l.pagevw/2
+  and y = getpagey l.pageno + row*conf.tileh + conf.tileh/2
+          - !S.y - !S.winh/2 in
+  let d = min (abs x + abs y) (1 lsl 28 - 1) in
+  if tilevisible !S.layout l.pageno (col*conf.tilew) (row*conf.tileh)
+  then d
+  else (
+    if U.pagevisible preloaded l.pageno
+    then 1 lsl 28 + max 0 (d - truncate (16.0 *. tilecost l.pageno))
+    else 1 lsl 29 + d
+  )
+
+(* with batching on, the missing tiles of a row go out as one strip
+   that is rendered in a single pass over the display list; with
+   progressive tiles on, visible ones go out alone and are preceded
+   by a coarse preview *)
 let tilepage n p layout =
+  let strip = ref [] in
+  let quality = if !S.moving then conf.motionquality else conf.quality in
+  let flush () =
+    begin match List.rev !strip with
+    | [] -> ()
+    | [(id, prio, x, y, w, h, progressive)] ->
+       wcmd U.tile "%d %d %s %d %d %d %d %d %d"
+         id prio (Opaque.to_string p) x y w h (btod progressive)
+         (QTE.to_int quality)
+    | (_, _, _, y, _, h, _) :: _ as tiles ->
+       let b = Buffer.create 64 in
+       let prio =
+         List.fold_left (fun prio (id, prio', x, _, w, _, _) ->
+             Printf.bprintf b " %d %d %d" id x w;
+             min prio prio') max_int tiles
+       in
+       wcmd U.tiles "%d %d %s %d %d %d%s" prio (QTE.to_int quality)
+         (Opaque.to_string p) y h (List.length tiles) (Buffer.contents b)
+    end;
+    strip := []
+  in
   let rec loop = function
     | l :: rest ->
        if l.pageno = n
        then
          let f col row _ _ _ _ _ _ =
-           if !S.currently = Idle
+           if canrequest ()
            then
              match gettileopaque l col row with
-             | Some _ -> ()
-             | None ->
+             | Some _ when not (tilepreviewed l col row
+                                || tiledraft l col row) -> ()
+             | _ when tilerequested l col row -> ()
+             | tile ->
                 let x = col*conf.tilew
                 and y = row*conf.tileh in
                 let w =
@@ -479,14 +704,31 @@ let tilepage n p layout =
                   let h = l.pageh - y in
                   min h conf.tileh
                 in
-                wcmd U.tile "%s %d %d %d %d" (Opaque.to_string p) x y w h;
-                S.currently :=
-                  Tiling (
-                      l, p, conf.colorspace, conf.angle,
-                      !S.gen, col, row, conf.tilew, conf.tileh
-                    );
+                let id =
+                  request (Rtile (l, conf.colorspace, conf.angle, !S.gen,
+                                  col, row, conf.tilew, conf.tileh))
+                in
+                if quality <> conf.quality
+                then Hashtbl.replace S.draftreqs id ();
+                let progressive =
+                  conf.progressivetiles && tile = None
+                  && tilevisible !S.layout l.pageno x y
+                in
+                (* a strip covers everything from its first to its last
+                   part, a column skipped in between would be rendered
+                   for nothing *)
+                begin match !strip with
+                | (_, _, x', y', w', _, _) :: _
+                     when y' != y || x != x' + w' || progressive -> flush ()
+                | _ -> ()
+                end;
+                strip := (id, tileprio layout l col row, x, y, w, h,
+                          progressive) :: !strip;
+                if progressive || not conf.batchtiles
+                then flush ()
          in
          itertiles l f;
+         flush ()
        else loop rest
 
     | [] -> ()
@@ -501,28 +743,76 @@ let preloadlayout x y sw sh =
   let w = sw*3 in
   layout x y w h
 
+(* re-rank the tiles still queued on the render side for the current
+   view and cancel the ones that would not be usable anymore *)
+let reschedule () =
+  let preloaded =
+    if conf.preload
+    then preloadlayout !S.x !S.y !S.winw !S.winh
+    else !S.layout
+  in
+  let prios =
+    Hashtbl.fold (fun id r accu ->
+        match r with
+        | Rpage _ -> accu
+        | Rtile (l, cs, angle, gen, col, row, tilew, tileh) ->
+           let (_, pw, ph, _) = getpagedim l.pageno in
+           let prio =
+             if gen = !S.gen
+                && cs = conf.colorspace
+                && angle = conf.angle
+                && tilew = conf.tilew
+                && tileh = conf.tileh
+                && pw = l.pagew
+                && ph = l.pageh
+             then
+               let l =
+                 match List.find (fun l' -> l'.pageno = l.pageno) preloaded with
+                 | l' -> l'
+                 | exception Not_found -> l
+               in
+               tileprio preloaded l col row
+             else -1
+           in
+           (id, prio) :: accu
+      ) S.requests []
+  in
+  if prios != []
+  then Ffi.reprioritize @@ Array.of_list prios
+
 let load pages =
   let rec loop pages =
-    if !S.currently = Idle
+    if canrequest ()
     then
       match pages with
       | l :: rest ->
          begin match getopaque l.pageno with
          | exception Not_found ->
-            wcmd U.page "%d %d" l.pageno l.pagedimno;
-            S.currently := Loading (l, !S.gen);
+            if not (pagerequested l.pageno)
+            then (
+              let id = request (Rpage (l, !S.gen)) in
+              let prio =
+                if U.pagevisible !S.layout l.pageno
+                then 0
+                else
+                  1 lsl 28
+                  - min (1 lsl 20) (truncate (1e3 *. loadcost l.pageno))
+              in
+              wcmd U.page "%d %d %d %d" id prio l.pageno l.pagedimno;
+            );
+            loop rest
          | opaque ->
             tilepage l.pageno opaque pages;
             loop rest
          end
-      | _ -> ()
+      | [] -> ()
   in
   if U.nogeomcmds !S.geomcmds
   then loop pages
 
 let preload pages =
   load pages;
-  if conf.preload && !S.currently = Idle
+  if conf.preload && canrequest ()
   then load (preloadlayout !S.x !S.y !S.winw !S.winh)
 
 let alltilesrendered layout =
@@ -542,8 +832,33 @@ let alltilesrendered layout =
   in
   fold layout
 
+(* the view is taken to be moving while it keeps changing more often
+   than this, tiles requested then are rendered at motion-quality *)
+let settletime = 0.15
+
+let notemotion x y =
+  if x != !S.x || y != !S.y
+  then (
+    let t = now () in
+    S.moving := conf.motionquality <> conf.quality
+                && t -. !S.lastmove < settletime;
+    S.lastmove := t;
+  )
+
+let settle () =
+  if !S.moving && now () -. !S.lastmove >= settletime
+  then (
+    S.moving := false;
+    load !S.layout;
+    Glutils.postRedisplay "settle";
+  )
+
+let settledeadline () =
+  if !S.moving then !S.lastmove +. settletime else infinity
+
 let gotoxy x y =
   let y = bound y 0 !S.maxy in
+  notemotion x y;
   let y, layout =
     let layout = layout x y !S.winw !S.winh in
     Glutils.postRedisplay "gotoxy ready";
@@ -552,6 +867,7 @@ let gotoxy x y =
   S.x := x;
   S.y := y;
   S.layout := layout;
+  reschedule ();
   begin match !S.mode with
   | LinkNav ln ->
      begin match ln with
@@ -671,21 +987,66 @@ let invalidate s f =
 
 let flushpages () =
   Hashtbl.iter (fun _ opaque -> wcmd1 U.freepage opaque) S.pagemap;
-  Hashtbl.clear S.pagemap
+  Hashtbl.clear S.pagemap;
+  Hashtbl.clear S.twins;
+  Hashtbl.clear S.fingerprints
 
 let flushtiles () =
-  if not (Queue.is_empty S.tilelru)
+  if Hashtbl.length S.tilemap > 0
   then (
-    Queue.iter (fun (k, p, s) ->
+    Hashtbl.iter (fun _ (p, s, _) ->
         wcmd1 U.freetile p;
         S.memused := !S.memused - s;
-        Hashtbl.remove S.tilemap k;
-      ) S.tilelru;
-    !S.uioh#infochanged Memused;
+      ) S.tilemap;
+    Hashtbl.clear S.tilemap;
+    Hashtbl.clear S.previews;
+    Hashtbl.clear S.packed;
+    Hashtbl.clear S.drafts;
+    Hashtbl.clear S.lrustamps;
     Queue.clear S.tilelru;
+    !S.uioh#infochanged Memused;
   );
+  Hashtbl.clear S.twinhits;
+  reschedule ();
   load !S.layout
 
+(* with bake-colors the tiles carry the inversion and gamma themselves
+   and have to be redone when those change *)
+let setbake () =
+  Ffi.setbake conf.bakecolors conf.invert conf.tilegamma conf.texturecolor;
+  if conf.bakecolors then flushtiles ()
+
+(* a page whose content changed (annotations) takes the tiles kept
+   under its number with it, twins may have rendered some of those *)
+let droptilesof n =
+  Hashtbl.fold (fun ((n', _, _, _, _, _, _, _) as k) _ accu ->
+      if n' = n then k :: accu else accu
+    ) S.tilemap []
+  |> List.iter droptile;
+  !S.uioh#infochanged Memused
+
+(* the first page loaded with a given fingerprint lends its tiles to
+   the ones loaded after it, "0" is a page that could not be hashed *)
+let sharetiles n fingerprint =
+  let stale =
+    Hashtbl.fold (fun fingerprint' m stale ->
+        stale || (m = n && fingerprint' <> fingerprint)) S.fingerprints false
+  in
+  if stale
+  then (
+    let drop _ m = if m = n then None else Some m in
+    Hashtbl.filter_map_inplace drop S.fingerprints;
+    Hashtbl.filter_map_inplace drop S.twins;
+    droptilesof n;
+  );
+  Hashtbl.remove S.twins n;
+  if conf.sharepages && fingerprint <> "0"
+  then
+    match Hashtbl.find_opt S.fingerprints fingerprint with
+    | Some m when m <> n -> Hashtbl.replace S.twins n m
+    | Some _ -> ()
+    | None -> Hashtbl.replace S.fingerprints fingerprint n
+
 let stateh h =
   let h = truncate (float h*.conf.zoom) in
   let d = conf.interpagespace lsl (if conf.presentation then 1 else 0) in
@@ -712,16 +1073,43 @@ let settitle title =
   if not !S.ignoredoctitlte
   then Wsi.settitle @@ title ^ " - llpp"
 
+let setbuckets () =
+  if conf.buckettiles
+  then Ffi.setbuckets conf.tilew conf.tileh
+  else Ffi.setbuckets 0 0
+
+(* the tile budget can send known heavy pages to previews up front *)
+let seedcosts () =
+  Hashtbl.iter (fun n _ ->
+      let ms = tilecost n in
+      if ms > 0.0
+      then wcmd U.cost "%d %f" n (ms /. 1e3)
+    ) S.pagecosts
+
 let opendoc path mimetype password =
+  if path = !S.path && Hashtbl.length S.pagecosts > 0
+  then storecosts ();
   S.path := path;
   S.mimetype := mimetype;
   S.password := password;
   S.gen := !S.gen + 1;
+  (* replies to what the previous document still had in flight are
+     freed as they come *)
+  Hashtbl.clear S.requests;
+  Hashtbl.clear S.draftreqs;
+  Hashtbl.clear S.partials;
   S.docinfo := [];
   S.outlines := [||];
 
   flushpages ();
   Ffi.setaalevel conf.aalevel;
+  Ffi.settilebudget conf.tilebudget;
+  Ffi.setpiglimit conf.memlimit;
+  setbuckets ();
+  Ffi.setbandedtiles conf.bandedtiles;
+  Ffi.setsharepages conf.sharepages;
+  Ffi.setbake conf.bakecolors conf.invert conf.tilegamma conf.texturecolor;
+  Ffi.setpbo conf.pbouploads;
   Ffi.setpapercolor conf.papercolor;
   Ffi.setdcf conf.dcf;
 
@@ -729,6 +1117,8 @@ let opendoc path mimetype password =
   wcmd U.dopen "%d %d %d %d %s\000%s\000%s\000%s\000"
     (btod conf.usedoccss) conf.rlw conf.rlh conf.rlem
     path mimetype password conf.css;
+  loadcosts ();
+  seedcosts ();
   invalidate "reqlayout"
     (fun () ->
       wcmd U.reqlayout " %d %d %d %s\000"
@@ -922,32 +1312,63 @@ let reshape ?(firsttime=false) w h =
       wcmd U.geometry "%d %d %d" w (stateh h) (FMTE.to_int conf.fitmodel)
     )
 
+(* a tile that merely scrolled away is likely to come back, with
+   pack-cold-tiles it is kept run-length encoded instead of dropped *)
+let packcold k p s =
+  if conf.packtiles
+     && not (Hashtbl.mem S.packed k)
+     && not (Hashtbl.mem S.previews k)
+  then
+    let s' = Ffi.packtile p in
+    if s' < s
+    then (
+      S.memused := !S.memused - s + s';
+      !S.uioh#infochanged Memused;
+      Hashtbl.replace S.packed k ();
+      begin match Hashtbl.find_opt S.tilemap k with
+      | Some (_, _, t) -> Hashtbl.replace S.tilemap k (p, s', t)
+      | None -> ()
+      end;
+      lrupush k;
+      true
+    )
+    else false
+  else false
+
 let gctilesnotinlayout layout =
   let len = Queue.length S.tilelru in
   let rec loop qpos =
     if !S.memused > conf.memlimit
     then (
-      if qpos < len
+      if qpos < len && not (Queue.is_empty S.tilelru)
       then
-        let (k, p, s) as lruitem = Queue.pop S.tilelru in
-        let n, gen, colorspace, angle, pagew, pageh, col, row = k in
-        let (_, pw, ph, _) = getpagedim n in
-        if   gen = !S.gen
+        let (k, _) as lruitem = Queue.pop S.tilelru in
+        begin match Hashtbl.find_opt S.tilemap k with
+        | Some (p, s, _) when lrulive lruitem ->
+           let n, gen, colorspace, angle, pagew, pageh, col, row = k in
+           let (_, pw, ph, _) = getpagedim n in
+           let current =
+             gen = !S.gen
              && colorspace = conf.colorspace
              && angle = conf.angle
              && pagew = pw
              && pageh = ph
-             && (
-               let x = col*conf.tilew and y = row*conf.tileh in
-               tilevisible layout n x y
-             )
-        then Queue.push lruitem S.tilelru
-        else (
-          wcmd1 U.freetile p;
-          S.memused := !S.memused - s;
-          !S.uioh#infochanged Memused;
-          Hashtbl.remove S.tilemap k;
-        );
+           in
+           if current && (
+                let x = col*conf.tilew and y = row*conf.tileh in
+                List.exists (fun l ->
+                    twin l.pageno = n && tilevisible layout l.pageno x y
+                  ) layout
+              )
+           then Queue.push lruitem S.tilelru
+           else if current && packcold k p s
+           then ()
+           else (
+             droptile k;
+             !S.uioh#infochanged Memused;
+           )
+        | Some _ | None -> ()
+        end;
         loop (qpos+1)
     )
   in
@@ -1026,9 +1447,6 @@ let act cmds =
     match !S.currently with
     | Outlining outlines -> S.currently := Outlining (outline :: outlines)
     | Idle -> S.currently := Outlining [outline]
-    | Loading _ | Tiling _ ->
-       dolog "Invalid outlining state";
-       logcurrently !S.currently
   in
   match spl with
   | "clear", "" ->
@@ -1046,7 +1464,7 @@ let act cmds =
      | Outlining l ->
         S.currently := Idle;
         S.outlines := Array.of_list (List.rev l)
-     | Idle | Loading _ | Tiling _ -> ()
+     | Idle -> ()
      end;
 
      let cur, cmds = !S.geomcmds in
@@ -1109,12 +1527,21 @@ let act cmds =
        (pageno, color, (x0, y0, x1, y1, x2, y2, x3, y3)) :: !S.rects1
 
   | "page", args ->
-     let pageopaques, t = scan args "%s %f" (fun p t -> p, t) in
+     let id, pageopaques, t, fingerprint =
+       scan args "%u %s %f %s" (fun id p t f -> id, p, t, f)
+     in
      let pageopaque = Opaque.of_string pageopaques in
-     begin match !S.currently with
-     | Loading (l, gen) ->
+     begin match Hashtbl.find_opt S.requests id with
+     | Some (Rpage (_, gen)) when gen <> !S.gen ->
+        (* loaded for a document that is no longer open *)
+        Hashtbl.remove S.requests id;
+        wcmd1 U.freepage pageopaque
+     | Some (Rpage (l, _)) ->
+        Hashtbl.remove S.requests id;
         vlog "page %d took %f sec" l.pageno t;
-        Hashtbl.replace S.pagemap (l.pageno, gen) pageopaque;
+        notecost l.pageno (fun (_, r) -> t, r);
+        Hashtbl.replace S.pagemap l.pageno pageopaque;
+        sharetiles l.pageno fingerprint;
         let preloadedpages =
           if conf.preload
           then preloadlayout !S.x !S.y !S.winw !S.winh
@@ -1125,11 +1552,11 @@ let act cmds =
                       IntSet.empty preloadedpages
           in
           let evictedpages =
-            Hashtbl.fold (fun ((pageno, _) as key) opaque accu ->
+            Hashtbl.fold (fun pageno opaque accu ->
                 if not (IntSet.mem pageno set)
                 then (
                   wcmd1 U.freepage opaque;
-                  key :: accu
+                  pageno :: accu
                 )
                 else accu
               ) S.pagemap []
@@ -1137,48 +1564,47 @@ let act cmds =
           List.iter (Hashtbl.remove S.pagemap) evictedpages;
         in
         evict ();
-        S.currently := Idle;
-        if gen = !S.gen
+        tilepage l.pageno pageopaque !S.layout;
+        load !S.layout;
+        load preloadedpages;
+        let visible = U.pagevisible !S.layout l.pageno in
+        if visible
         then (
-          tilepage l.pageno pageopaque !S.layout;
-          load !S.layout;
-          load preloadedpages;
-          let visible = U.pagevisible !S.layout l.pageno in
-          if visible
-          then (
-            match !S.mode with
-            | LinkNav (Ltnotready (pageno, dir)) ->
-               if pageno = l.pageno
-               then (
-                 let link =
-                   let ld =
-                     if dir = 0
-                     then LDfirstvisible (l.pagex, l.pagey, dir)
-                     else if dir > 0 then LDfirst else LDlast
-                   in
-                   Ffi.findlink pageopaque ld
+          match !S.mode with
+          | LinkNav (Ltnotready (pageno, dir)) ->
+             if pageno = l.pageno
+             then (
+               let link =
+                 let ld =
+                   if dir = 0
+                   then LDfirstvisible (l.pagex, l.pagey, dir)
+                   else if dir > 0 then LDfirst else LDlast
                  in
-                 match link with
-                 | Lnotfound -> ()
-                 | Lfound n ->
-                    showlinktype (Ffi.getlink pageopaque n);
-                    S.mode := LinkNav (Ltexact (l.pageno, n))
-               )
-            | LinkNav (Ltgendir _)
-            | LinkNav (Ltexact _)
-            | View
-            | Birdseye _
-            | Textentry _ -> ()
-          );
+                 Ffi.findlink pageopaque ld
+               in
+               match link with
+               | Lnotfound -> ()
+               | Lfound n ->
+                  showlinktype (Ffi.getlink pageopaque n);
+                  S.mode := LinkNav (Ltexact (l.pageno, n))
+             )
+          | LinkNav (Ltgendir _)
+          | LinkNav (Ltexact _)
+          | View
+          | Birdseye _
+          | Textentry _ -> ()
+        );
 
-          if visible && alltilesrendered !S.layout
-          then Glutils.postRedisplay "page";
-        )
+        if visible && alltilesrendered !S.layout
+        then Glutils.postRedisplay "page"
 
-     | Idle | Tiling _ | Outlining _ ->
+     | Some (Rtile _ as r) ->
         dolog "Inconsistent loading state";
-        logcurrently !S.currently;
+        logrequest id r;
         exit 1
+     | None ->
+        dolog "page reply for unknown request %d" id;
+        wcmd1 U.freepage pageopaque
      end
 
   | "tile" , args ->
@@ -1194,51 +1620,138 @@ let act cmds =
        if tile is visible post redisplay
        continue tiling
       *)
-     let (x, y, opaques, size, t) =
-       scan args "%u %u %s %u %f" (fun x y p size t -> (x, y, p, size, t))
+     let (id, x, y, opaques, size, t) =
+       scan args "%u %u %u %s %u %f"
+         (fun id x y p size t -> (id, x, y, p, size, t))
      in
      let opaque = Opaque.of_string opaques in
-     begin match !S.currently with
-     | Tiling (l, pageopaque, cs, angle, gen, col, row, tilew, tileh) ->
+     droppartial id;
+     begin match Hashtbl.find_opt S.requests id with
+     | Some (Rtile (l, cs, angle, gen, col, row, tilew, tileh)) ->
+        Hashtbl.remove S.requests id;
         vlog "tile %d [%d,%d] took %f sec" l.pageno col row t;
         let layout =
           if conf.preload && alltilesrendered !S.layout
           then preloadlayout !S.x !S.y !S.winw !S.winh
           else !S.layout
         in
-        if tilew != conf.tilew || tileh != conf.tileh
+        let key = twin l.pageno, gen, cs, angle, l.pagew, l.pageh, col, row in
+        let draft = Hashtbl.mem S.draftreqs id in
+        Hashtbl.remove S.draftreqs id;
+        (* a late draft must not displace the finished tile *)
+        let superseded =
+          draft && Hashtbl.mem S.tilemap key
+          && not (Hashtbl.mem S.drafts key || Hashtbl.mem S.previews key)
+        in
+        if tilew != conf.tilew || tileh != conf.tileh || superseded
         then (
           wcmd1 U.freetile opaque;
-          S.currently := Idle;
           load layout;
         )
         else (
           puttileopaque l col row gen cs angle opaque size t;
+          if draft
+          then Hashtbl.replace S.drafts key ()
+          else notetilecost l.pageno
+                 (min tilew (l.pagew - x)) (min tileh (l.pageh - y)) t;
           S.memused := !S.memused + size;
           !S.uioh#infochanged Memused;
           gctilesnotinlayout !S.layout;
-          Queue.push ((l.pageno, gen, cs, angle, l.pagew, l.pageh, col, row),
-                      opaque, size) S.tilelru;
+          lrupush key;
 
-          S.currently := Idle;
           let visible = tilevisible layout l.pageno x y in
+          (* only what is about to be drawn is worth a pixel buffer,
+             preloaded tiles would just push those out of the ring *)
+          if tilevisible !S.layout l.pageno x y
+          then Ffi.stagetile opaque;
           let cont = gen = !S.gen && conf.colorspace = cs
                      && conf.angle = angle && visible
           in
 
           if cont
-          then conttiling l.pageno pageopaque;
+          then (
+            match getopaque l.pageno with
+            | pageopaque -> conttiling l.pageno pageopaque
+            | exception Not_found -> ()
+          );
           preload layout;
           if cont
           then Glutils.postRedisplay "tile nothrottle";
         )
 
-     | Idle | Loading _ | Outlining _ ->
+     | Some (Rpage _ as r) ->
         dolog "Inconsistent tiling state";
-        logcurrently !S.currently;
+        logrequest id r;
         exit 1
+     | None ->
+        dolog "tile reply for unknown request %d" id;
+        wcmd1 U.freetile opaque
+     end
+
+  | "tilepreview", args ->
+     let (id, opaque, size, t) =
+       scan args "%u %u %u %s %u %f"
+         (fun id _ _ p size t -> (id, Opaque.of_string p, size, t))
+     in
+     begin match Hashtbl.find_opt S.requests id with
+     | Some (Rtile (l, cs, angle, gen, col, row, tilew, tileh))
+          when tilew = conf.tilew && tileh = conf.tileh ->
+        let key =
+          twin l.pageno, gen, cs, angle, l.pagew, l.pageh, col, row in
+        (* never in place of a sharper tile that got there first *)
+        if Hashtbl.mem S.tilemap key
+        then wcmd1 U.freetile opaque
+        else (
+          vlog "preview %d [%d,%d] took %f sec" l.pageno col row t;
+          puttileopaque l col row gen cs angle opaque size t;
+          S.memused := !S.memused + size;
+          !S.uioh#infochanged Memused;
+          Hashtbl.replace S.previews key ();
+          lrupush key;
+          Glutils.postRedisplay "tilepreview"
+        )
+     | Some _ | None -> wcmd1 U.freetile opaque
      end
 
+  | "tiledrop", args ->
+     let id = scan args "%u" (fun id -> id) in
+     Hashtbl.remove S.requests id;
+     Hashtbl.remove S.draftreqs id;
+     preload !S.layout
+
+  | "tileband", args ->
+     let id, opaque, y0, y1 =
+       scan args "%u %s %d %d"
+         (fun id p y0 y1 -> id, Opaque.of_string p, y0, y1)
+     in
+     begin match Hashtbl.find_opt S.requests id with
+     | Some (Rtile (l, cs, angle, gen, col, row, _, _)) ->
+        let key =
+          twin l.pageno, gen, cs, angle, l.pagew, l.pageh, col, row in
+        let bands =
+          match Hashtbl.find_opt S.partials key with
+          | Some (_, bands) -> bands
+          | None -> []
+        in
+        Hashtbl.replace S.partials key (opaque, (y0, y1) :: bands);
+        Glutils.postRedisplay "tileband"
+     | Some (Rpage _) | None -> ()
+     end
+
+  | "tileabort", args ->
+     let id, opaque =
+       scan args "%u %s" (fun id p -> id, Opaque.of_string p)
+     in
+     droppartial id;
+     Hashtbl.remove S.requests id;
+     Hashtbl.remove S.draftreqs id;
+     wcmd1 U.freetile opaque;
+     preload !S.layout
+
+  | "pageabort", args ->
+     let id = scan args "%u" (fun id -> id) in
+     Hashtbl.remove S.requests id
+
   | "pdim", args ->
      let (n, w, h, _) as pdim =
        scan args "%u %d %d %d" (fun n x w h -> n, w, h, x)
@@ -1422,6 +1935,13 @@ let settrim trimmargins trimfuzz =
   invalidate "settrim"
     (fun () -> wcmd U.settrim "%d %d %d %d %d"
                  (btod conf.trimmargins) x0 y0 x1 y1);
+  (* pages in flight were made for the old page dimensions, their
+     replies are freed as unknown *)
+  Hashtbl.filter_map_inplace (fun _ r ->
+      match r with
+      | Rpage _ -> None
+      | Rtile _ -> Some r
+    ) S.requests;
   flushpages ()
 
 let setzoom zoom =
@@ -1633,6 +2153,7 @@ let optentry mode _ key =
 
   | Keys.Ascii 'I' ->
      conf.invert <- not conf.invert;
+     setbake ();
      TEdone ("invert colors " ^ onoffs conf.invert)
 
   | Keys.Ascii 'x' ->
@@ -1850,6 +2371,7 @@ let genhistoutlines () =
        )
 
 let gotohist (path, c, bookmarks, x, anchor, origin) =
+  storecosts ();
   Config.save leavebirdseye;
   setconf conf c;
   let x0, y0, x1, y1 = conf.trimfuzz in
@@ -2014,6 +2536,31 @@ let enterinfomode =
                infomenu source
           )) :: m_l
 
+      method quality name get set =
+        m_l <-
+          (name, `string get, 1,
+           Some (fun _ ->
+               let source = object
+                   inherit lvsourcebase
+
+                   initializer
+                      m_active <- QTE.to_int (QTE.of_string (get ()));
+                      m_first <- 0;
+
+                    method getitemcount =
+                      Array.length QTE.names
+                    method getitem n =
+                      (QTE.names.(n), 0)
+                    method exit ~uioh ~cancel ~active ~first ~pan =
+                      ignore (uioh, first, pan);
+                      if not cancel then set active;
+                      None
+                    method hasaction _ = true
+                  end
+               in
+               infomenu source
+          )) :: m_l
+
       method paxmark name get set =
         m_l <-
           (name, `string get, 1,
@@ -2146,6 +2693,73 @@ let enterinfomode =
       (fun () -> conf.preload)
       (fun v -> conf.preload <- v);
 
+    src#bool "batch tile rows"
+      (fun () -> conf.batchtiles)
+      (fun v -> conf.batchtiles <- v);
+
+    src#bool "progressive tiles"
+      (fun () -> conf.progressivetiles)
+      (fun v -> conf.progressivetiles <- v);
+
+    src#bool "banded tile delivery"
+      (fun () -> conf.bandedtiles)
+      (fun v ->
+        conf.bandedtiles <- v;
+        Ffi.setbandedtiles v);
+
+    src#bool "pack cold tiles"
+      (fun () -> conf.packtiles)
+      (fun v -> conf.packtiles <- v);
+
+    src#bool "bake inversion into tiles"
+      (fun () -> conf.bakecolors)
+      (fun v ->
+        conf.bakecolors <- v;
+        Ffi.setbake v conf.invert conf.tilegamma conf.texturecolor;
+        flushtiles ());
+
+    src#string "tile gamma (baked)"
+      (fun () -> string_of_float conf.tilegamma)
+      (fun v ->
+        try
+          conf.tilegamma <- bound (float_of_string v) 0.1 10.0;
+          setbake ()
+        with exn ->
+          S.text := Printf.sprintf "bad tile gamma `%s': %s" v @@ exntos exn);
+
+    src#quality "render quality"
+      (fun () -> QTE.to_string conf.quality)
+      (fun v ->
+        conf.quality <- QTE.of_int v;
+        flushtiles ());
+
+    src#quality "render quality in motion"
+      (fun () -> QTE.to_string conf.motionquality)
+      (fun v -> conf.motionquality <- QTE.of_int v);
+
+    src#bool "stage uploads in pixel buffers"
+      (fun () -> conf.pbouploads)
+      (fun v ->
+        conf.pbouploads <- v;
+        Ffi.setpbo v);
+
+    src#bool "share tiles of identical pages"
+      (fun () -> conf.sharepages)
+      (fun v ->
+        conf.sharepages <- v;
+        Ffi.setsharepages v;
+        if not v
+        then (
+          Hashtbl.clear S.twins;
+          Hashtbl.clear S.fingerprints;
+        ));
+
+    src#bool "bucket display lists per tile"
+      (fun () -> conf.buckettiles)
+      (fun v ->
+        conf.buckettiles <- v;
+        setbuckets ());
+
     src#bool "highlight links"
       (fun () -> conf.hlinks)
       (fun v -> conf.hlinks <- v);
@@ -2246,7 +2860,9 @@ let enterinfomode =
     src#caption "Pixmap cache" 0;
     src#int_with_suffix "size (advisory)"
       (fun () -> conf.memlimit)
-      (fun v -> conf.memlimit <- v);
+      (fun v ->
+        conf.memlimit <- v;
+        Ffi.setpiglimit v);
 
     src#caption2 "used"
       (fun () ->
@@ -2254,6 +2870,23 @@ let enterinfomode =
           (string_with_suffix_of_int !S.memused)
           (Hashtbl.length S.tilemap)) 1;
 
+    sep ();
+    src#caption "Rendering" 0;
+    src#caption2 "requests in flight"
+      (fun () -> string_of_int (Hashtbl.length S.requests)) 1;
+    src#caption2 "pages sharing tiles"
+      (fun () -> string_of_int (Hashtbl.length S.twins)) 1;
+    src#caption2 "tiles taken from twins"
+      (fun () -> string_of_int (Hashtbl.length S.twinhits)) 1;
+    Array.iter (fun (name, _) ->
+        src#caption2 name
+          (fun () ->
+            match List.assoc_opt name
+                    (Array.to_list @@ Ffi.renderstats ()) with
+            | Some v -> v
+            | None -> E.s) 1
+      ) (Ffi.renderstats ());
+
     sep ();
     src#caption "Layout" 0;
     src#caption2 "Dimension"
@@ -2285,7 +2918,9 @@ let enterinfomode =
         (fun v -> conf.verbose <- v);
       src#bool "invert colors"
         (fun () -> conf.invert)
-        (fun v -> conf.invert <- v);
+        (fun v ->
+          conf.invert <- v;
+          setbake ());
       src#bool "max fit"
         (fun () -> conf.maxhfit)
         (fun v -> conf.maxhfit <- v);
@@ -2302,6 +2937,7 @@ let enterinfomode =
             let w, h = Scanf.sscanf v "%dx%d" (fun w h -> w, h) in
             conf.tilew <- max 64 w;
             conf.tileh <- max 64 h;
+            setbuckets ();
             flushtiles ();
           with exn -> settextfmt  "bad tile size `%s': %s" v @@ exntos exn);
       src#int "texture count"
@@ -2310,6 +2946,11 @@ let enterinfomode =
           if Ffi.realloctexts v
           then conf.texcount <- v
           else impmsg "failed to set texture count please retry later");
+      src#int "tile render budget (ms)"
+        (fun () -> conf.tilebudget)
+        (fun v ->
+          conf.tilebudget <- max 0 v;
+          Ffi.settilebudget conf.tilebudget);
       src#int "slice height"
         (fun () -> conf.sliceheight)
         (fun v ->
@@ -2384,6 +3025,7 @@ let enterinfomode =
         (fun v ->
           conf.colorspace <- CSTE.of_int v;
           wcmd U.cs "%d" v;
+          reschedule ();
           load !S.layout);
       src#paxmark "pax mark method"
         (fun () -> MTE.to_string conf.paxmark)
@@ -2432,6 +3074,7 @@ let enterinfomode =
           (fun v ->
             GlTex.env (`color v);
             conf.texturecolor <- v;
+            setbake ();
           );
         src#string "   scale"
           (fun () -> string_of_float conf.colorscale)
@@ -2719,16 +3362,18 @@ let enterannotmode opaque slinkindex =
       initializer m_active <- 0
     end
   in
-  S.text := E.s;
-  let s = Ffi.gettextannot opaque slinkindex in
-  resetmstate ();
-  msgsource#reset s;
-  let source = (msgsource :> lvsource) in
-  let modehash = findkeyhash conf "listview" in
-  object inherit listview ~zebra:false
-                   ~helpmode:false ~source ~trusted:false ~modehash
-  end |> setuioh;
-  Glutils.postRedisplay "enterannotmode"
+  match Ffi.gettextannot opaque slinkindex with
+  | None -> impmsg "document is busy please retry later"
+  | Some s ->
+     S.text := E.s;
+     resetmstate ();
+     msgsource#reset s;
+     let source = (msgsource :> lvsource) in
+     let modehash = findkeyhash conf "listview" in
+     object inherit listview ~zebra:false
+                      ~helpmode:false ~source ~trusted:false ~modehash
+     end |> setuioh;
+     Glutils.postRedisplay "enterannotmode"
 
 let gotoremote spec =
   let filename, dest = splitatchar spec '#' in
@@ -2799,15 +3444,19 @@ let gotounder = function
      if emptystr conf.savecmd
      then adderrmsg "savepath-command is empty"
             "don't know where to save attachment"
-     else
-       let filename = Ffi.getfileannot opaque slinkindex in
-       let savecmd = Str.global_replace Re.percents filename conf.savecmd in
-       let path =
-         getcmdoutput
-           (adderrfmt savecmd
-              "failed to obtain path to the saved attachment: %s") savecmd
-       in
-       Ffi.savefileannot opaque slinkindex path
+     else (
+       match Ffi.getfileannot opaque slinkindex with
+       | None -> impmsg "document is busy please retry later"
+       | Some filename ->
+          let savecmd =
+            Str.global_replace Re.percents filename conf.savecmd in
+          let path =
+            getcmdoutput
+              (adderrfmt savecmd
+                 "failed to obtain path to the saved attachment: %s") savecmd
+          in
+          Ffi.savefileannot opaque slinkindex path
+     )
 
 let gotooutline (_, _, kind) =
   match kind with
@@ -3658,7 +4307,10 @@ let linknavkeyboard key mask linknav =
 
 let keyboard key mask =
   if (key = Char.code 'g' && Wsi.withctrl mask) && not (istextentry !S.mode)
-  then wcmd U.interrupt ""
+  then (
+    Ffi.interrupt ();
+    wcmd U.interrupt ""
+  )
   else !S.uioh#key key mask |> setuioh
 
 let birdseyekeyboard key mask
@@ -3946,6 +4598,7 @@ let display () =
     );
     Gl.disable `blend;
   );
+  Ffi.endframe ();
   Wsi.swapb ()
 
 let display () =
@@ -3989,7 +4642,7 @@ let annot inline x y =
      let add text =
        Ffi.addannot opaque ux uy text;
        wcmd1 U.freepage opaque;
-       Hashtbl.remove S.pagemap (n, !S.gen);
+       Hashtbl.remove S.pagemap n;
        flushtiles ();
        gotoxy !S.x !S.y
      in
@@ -4755,7 +5408,8 @@ let () =
   S.stderr := Ffi.init cs (
                   conf.angle, conf.fitmodel, (conf.trimmargins, conf.trimfuzz),
                   conf.texcount, conf.sliceheight, conf.mustoresize,
-                  conf.colorspace, !S.fontpath, !S.redirstderr
+                  conf.colorspace, !S.fontpath, !S.redirstderr,
+                  conf.renderthreads
                 );
   List.iter GlArray.enable [`texture_coord; `vertex];
   GlTex.env (`color conf.texturecolor);
@@ -4794,6 +5448,7 @@ let () =
       doreap := false;
       reap ()
     );
+    settle ();
     let r =
       match !optrfd with
       | None -> fdl
@@ -4835,7 +5490,7 @@ let () =
             in
             gotoxy !S.x y;
             deadline +. 0.01
-         | _ -> infinity
+         | _ -> settledeadline ()
        in
        loop newdeadline
 
@@ -4879,7 +5534,7 @@ let () =
             if deadline = infinity
             then now () +. 0.01
             else deadline
-         | _ -> infinity
+         | _ -> settledeadline ()
        in
        loop newdeadline
     end;
@@ -4891,6 +5546,7 @@ let () =
       | n ->
          match Unix.write Unix.stdout (Buffer.to_bytes S.errmsgs) 0 n with
          | exception _ | _ -> ());
+     storecosts ();
      Config.save leavebirdseye;
      if Ffi.hasunsavedchanges ()
      then save ()